@@ -20,6 +20,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "defs.h"
+#include "rbtree.h"
 #include "proc.h"
 
 #define BACKSPACE 0x100
@@ -138,8 +139,10 @@ consoleintr(int c)
   acquire(&cons.lock);
 
   switch(c){
-  case C('P'):  // Print process list.
+  case C('P'):  // Print process list and free memory.
     procdump();
+    kmemdump();
+    slabdump();
     break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
@@ -8,7 +8,14 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
 struct perf;
+struct rbnode;
+struct rbroot;
+struct sched_class;
+struct kmem_cache;
+struct execseg;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -25,6 +32,8 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+struct execseg* execseg(struct proc*, uint64);
+char*           execload(struct proc*, struct execseg*, uint64);
 
 // file.c
 struct file*    filealloc(void);
@@ -53,7 +62,12 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
-void            itrunc(struct inode*);
+int             itrunc(struct inode*);
+char*           itext(struct inode*, uint, uint);
+void            itextfree(struct inode*);
+char*           ipage(struct inode*, uint);
+void            ipagesfree(struct inode*);
+void            iexec(struct inode*, int);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -64,6 +78,13 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            kalloc_test(void);
+void            kmemdump(void);
+void            kref(void *);
+int             krefs(void *);
+uint            kshortage(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -71,7 +92,19 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+void            vmainit(void);
+uint64          mmap(uint64, uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
+uint64          vmabase(struct proc*);
+struct vma*     vmafind(struct proc*, uint64);
+int             vmafault(struct proc*, struct vma*, uint64, int);
+int             vmacopy(struct proc*, struct proc*, int);
+int             vmaunshare(struct proc*);
+int             vmaclear(struct proc*, int);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -86,8 +119,10 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
-void            proc_mapstacks(pagetable_t);
+uint64          growproc(int);
+int             pagefault(pagetable_t, uint64, int);
+void            prefault(uint64, int);
+void            reclaim(void);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -102,7 +137,6 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
-void            update_time();
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -110,6 +144,39 @@ void            procdump(void);
 int             trace(int, int);
 int             wait_stat(uint64 status, uint64 performance);
 int             set_priority(int);
+int             resched(void);
+int             sched_setpolicy(int, int);
+int             sched_tick(void);
+int             sched_setdeadline(int, int, int);
+int             clone(uint64, uint64, int, uint64);
+int             join(int, uint64);
+int             futex_wait(uint64, int);
+int             futex_wake(uint64, int);
+void            sched_throttle(void);
+
+// rbtree.c
+void            rb_insert(struct rbroot*, struct rbnode*, int (*)(struct rbnode*, struct rbnode*));
+void            rb_erase(struct rbroot*, struct rbnode*);
+struct rbnode*  rb_first(struct rbroot*);
+struct rbnode*  rb_next(struct rbnode*);
+
+// sched.c
+extern struct sched_class *sched_class[];
+extern int      sched_default;
+void            sched_init(void);
+int             edf_admit(struct proc*, uint);
+int             srt_reserve(int);
+void            srt_shrink(int);
+
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void*           kmalloc(uint);
+void            kmfree(void*);
+void            slabdump(void);
+void            slabidle(void);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -145,12 +212,24 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            timer_init(void);
+void            timer_add(struct timer*, uint);
+int             timer_del(struct timer*);
+void            timer_tick(void);
+int             timer_sleep(int);
+uint            timer_next(void);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            setdeadline(uint64);
+uint64          nexttick(void);
+void            tickcatchup(void);
+void            ipi(int);
 
 // uart.c
 void            uartinit(void);
@@ -168,10 +247,14 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+int             uvmunshare(pagetable_t, uint64, uint64);
+int             uvmlazy(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t*          walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -3,24 +3,40 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "rbtree.h"
 #include "proc.h"
+#include "fs.h"
+#include "file.h"
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+static int mapshared(pagetable_t, struct inode*, struct execseg*);
+
+// The program's segments are not read in by exec():
+// pagefault() loads each page from the executable
+// the first time the program touches it. Pages of
+// read-only segments are shared by all processes running
+// the executable, and those already in memory are mapped
+// at once.
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct execseg seg[NSEG];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // other threads would be left running in the old image.
+  if(p->leader != p || p->threads)
+    return -1;
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -38,7 +54,7 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Note where the program's segments go.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,17 +64,29 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz >= MMAPTOP)
       goto bad;
-    sz = sz1;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nseg == NSEG)
       goto bad;
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].off = ph.off;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].text = (ph.flags & ELF_PROG_FLAG_WRITE) == 0 && ph.off % PGSIZE == 0;
+    nseg++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  for(i = 0; i < nseg; i++)
+    if(seg[i].text && mapshared(pagetable, ip, &seg[i]) < 0)
+      goto bad;
+  // keep the reference, to load pages from, and keep
+  // the file from changing under them.
+  iexec(ip, 1);
+  iunlock(ip);
   end_op();
+  exe = ip;
   ip = 0;
 
   p = myproc();
@@ -102,6 +130,11 @@ exec(char *path, char **argv)
   // value, which goes in a0.
   p->trapframe->a1 = sp;
 
+  // the old image's mmap() regions go with it; exec()
+  // fails if their pages can't be written back.
+  if(vmaclear(p, 1) < 0)
+    goto bad;
+
   // Save program name for debugging.
   for(last=s=path; *s; s++)
     if(*s == '/')
@@ -114,7 +147,17 @@ exec(char *path, char **argv)
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  oldexe = p->exe;
+  p->exe = exe;
+  memmove(p->seg, seg, sizeof(seg));
+  p->nseg = nseg;
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    iexec(oldexe, -1);
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -125,33 +168,80 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    iexec(exe, -1);
+    begin_op();
+    iput(exe);
+    end_op();
+  }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
+// The segment of the leader p's program with file data in
+// page va, or 0.
+struct execseg*
+execseg(struct proc *p, uint64 va)
+{
+  struct execseg *s;
+
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    if(va >= s->va && va < s->va + s->filesz)
+      return s;
+  return 0;
+}
+
+// Return a page holding page va of segment s of the leader
+// p's program: the executable's shared copy if s is
+// read-only text, else a private copy. Returns 0 if memory
+// runs out or the file can't be read.
+char*
+execload(struct proc *p, struct execseg *s, uint64 va)
+{
+  char *mem;
+  uint off = s->off + (va - s->va);
+  uint n = PGSIZE;
+  int locked;
+
+  if(s->va + s->filesz - va < n)
+    n = s->va + s->filesz - va;
+  // read() of the executable itself into an unloaded page
+  // faults with the inode locked already.
+  if((locked = holdingsleep(&p->exe->lock)) == 0)
+    ilock(p->exe);
+  if(s->text){
+    mem = itext(p->exe, off, n);
+  } else if((mem = kalloc()) != 0){
+    memset(mem, 0, PGSIZE);
+    if(readi(p->exe, 0, (uint64)mem, off, n) != n){
+      kfree(mem);
+      mem = 0;
+    }
+  }
+  if(!locked)
+    iunlock(p->exe);
+  return mem;
+}
+
+// Map the pages of text segment s that processes already
+// running ip have read in. Caller must hold ip->lock.
 static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+mapshared(pagetable_t pagetable, struct inode *ip, struct execseg *s)
 {
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
+  uint64 va;
+  uint i;
+  char *mem;
+
+  if(ip->text == 0)
+    return 0;
+  for(va = s->va; va < s->va + s->filesz; va += PGSIZE){
+    i = (s->off + (va - s->va)) / PGSIZE;
+    if(i >= NTEXT || (mem = ip->text[i]) == 0)
+      continue;
+    kref(mem);
+    if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_X|PTE_U) != 0){
+      kfree(mem);
       return -1;
+    }
   }
-  
   return 0;
 }
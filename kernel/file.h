@@ -18,6 +18,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // Next in the itable hash chain
+  struct inode *lrunext; // Newer in itable's unused list, if ref is 0
+  struct inode *lruprev; // Older
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,8 +30,13 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+  char **text;        // Read-only pages of running programs, by file page
+  char **pages;       // Pages of MAP_SHARED mappings, by file page
+  int nexec;          // Processes running it as their program; see iexec()
 };
 
+#define NTEXT ((MAXFILE*BSIZE + PGSIZE - 1) / PGSIZE)  // pages in a file
+
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
@@ -15,6 +15,7 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
@@ -127,18 +128,22 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref.
+//   Entries come from a slab cache, as many as are in use.
+//   An entry whose ref falls to zero stays in the table,
+//   so that it needn't be read from disk again if it is
+//   looked up soon, on a list of unused entries from
+//   which iget() recycles the oldest once the table holds
+//   NINODE more than are in use.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -163,32 +168,84 @@ bfree(int dev, uint b)
 // multi-step atomic operations.
 //
 // The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// entries and the hash chains that find them. Since ip->ref
+// indicates whether an entry is in use, and ip->dev and ip->inum
+// indicate which i-node an entry holds, one must hold itable.lock
+// while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 64
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  int n;                        // entries
+  int nunused;                  // entries with ref 0
+  struct inode *hash[NIHASH];   // entries by dev and inum
+  struct inode *oldest;         // unused entries, by last use
+  struct inode *newest;
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode));
+}
+
+static struct inode**
+ihash(uint dev, uint inum)
+{
+  return &itable.hash[(dev * 31 + inum) % NIHASH];
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// Put ip, whose ref has fallen to 0, on the unused list.
+// Caller must hold itable.lock, as for the rest of these.
+static void
+unused_insert(struct inode *ip)
+{
+  ip->lrunext = 0;
+  ip->lruprev = itable.newest;
+  if(itable.newest)
+    itable.newest->lrunext = ip;
+  else
+    itable.oldest = ip;
+  itable.newest = ip;
+  itable.nunused++;
+}
+
+static void
+unused_remove(struct inode *ip)
+{
+  if(ip->lruprev)
+    ip->lruprev->lrunext = ip->lrunext;
+  else
+    itable.oldest = ip->lrunext;
+  if(ip->lrunext)
+    ip->lrunext->lruprev = ip->lruprev;
+  else
+    itable.newest = ip->lruprev;
+  itable.nunused--;
+}
+
+// Take the unused entry ip out of the table.
+static void
+ievict(struct inode *ip)
+{
+  struct inode **pp;
+
+  unused_remove(ip);
+  for(pp = ihash(ip->dev, ip->inum); *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
+  itable.n--;
+}
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode.
@@ -242,31 +299,41 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **chain;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  chain = ihash(dev, inum);
+  for(ip = *chain; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        unused_remove(ip);
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  // Recycle the oldest unused entry if there are enough,
+  // or else allocate one.
+  ip = 0;
+  if(itable.nunused >= NINODE || (ip = kmem_cache_alloc(itable.cache)) == 0){
+    if((ip = itable.oldest) == 0)
+      panic("iget: no memory");
+    ievict(ip);
+  }
+  itable.n++;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->text = 0;
+  ip->pages = 0;
+  ip->nexec = 0;
+  ip->lrunext = ip->lruprev = 0;
+  initsleeplock(&ip->lock, "inode");
+  ip->next = *chain;
+  *chain = ip;
   release(&itable.lock);
 
   return ip;
@@ -324,7 +391,7 @@ iunlock(struct inode *ip)
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled, though it stays cached until it is.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -353,7 +420,18 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    itextfree(ip);
+    ipagesfree(ip);
+    unused_insert(ip);
+    // an inode freed on disk isn't worth keeping.
+    if(ip->valid == 0 || itable.nunused > NINODE){
+      if(ip->valid)
+        ip = itable.oldest;
+      ievict(ip);
+      kmem_cache_free(itable.cache, ip);
+    }
+  }
   release(&itable.lock);
 }
 
@@ -405,14 +483,19 @@ bmap(struct inode *ip, uint bn)
 }
 
 // Truncate inode (discard contents).
+// Returns -1 if a process is running ip as its program.
 // Caller must hold ip->lock.
-void
+int
 itrunc(struct inode *ip)
 {
   int i, j;
   struct buf *bp;
   uint *a;
 
+  if(ip->nexec > 0)
+    return -1;
+  itextfree(ip);
+  ipagesfree(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -434,6 +517,7 @@ itrunc(struct inode *ip)
 
   ip->size = 0;
   iupdate(ip);
+  return 0;
 }
 
 // Copy stat information from inode.
@@ -457,6 +541,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *pg;
 
   if(off > ip->size || off + n < off)
     return 0;
@@ -464,8 +549,16 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    // a shared mapping's page is newer than the disk.
+    if(ip->pages && (pg = ip->pages[off / PGSIZE]) != 0){
+      if(either_copyout(user_dst, dst, pg + off % PGSIZE, m) == -1){
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -488,12 +581,18 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *pg;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  // running programs load their pages from ip on demand.
+  if(ip->nexec > 0)
+    return -1;
 
+  // programs started from now on see the new contents.
+  itextfree(ip);
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
@@ -501,6 +600,9 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    // shared mappings see the write at once.
+    if(ip->pages && (pg = ip->pages[off / PGSIZE]) != 0)
+      memmove(pg + off % PGSIZE, bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -516,6 +618,108 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return tot;
 }
 
+// Return the page of cache (ip->text or ip->pages) for
+// off, reading in the n bytes of ip at off followed by
+// zeroes if it isn't there yet, with a reference for the
+// caller. Caller must hold ip->lock.
+static char*
+icache(struct inode *ip, char ***cache, uint off, uint n)
+{
+  char *mem;
+
+  if(off % PGSIZE != 0 || off / PGSIZE >= NTEXT || n > PGSIZE)
+    return 0;
+  if(*cache == 0){
+    if((*cache = kmalloc(NTEXT * sizeof(char*))) == 0)
+      return 0;
+    memset(*cache, 0, NTEXT * sizeof(char*));
+  }
+  if((mem = (*cache)[off / PGSIZE]) == 0){
+    if((mem = kalloc()) == 0)
+      return 0;
+    memset(mem, 0, PGSIZE);
+    if(readi(ip, 0, (uint64)mem, off, n) != n){
+      kfree(mem);
+      return 0;
+    }
+    (*cache)[off / PGSIZE] = mem;
+  }
+  kref(mem);
+  return mem;
+}
+
+static void
+icachefree(char ***cache)
+{
+  int i;
+
+  if(*cache == 0)
+    return;
+  for(i = 0; i < NTEXT; i++)
+    if((*cache)[i])
+      kfree((*cache)[i]);
+  kmfree(*cache);
+  *cache = 0;
+}
+
+// Return a read-only page holding the n bytes of ip at
+// off followed by zeroes, shared by every process running
+// ip as a program, with a reference for the caller.
+// off must be page-aligned. Returns 0 if memory runs out
+// or the read fails. Caller must hold ip->lock.
+char*
+itext(struct inode *ip, uint off, uint n)
+{
+  return icache(ip, &ip->text, off, n);
+}
+
+// Return the page of ip at off, shared by every MAP_SHARED
+// mapping of ip, with a reference for the caller. Bytes
+// past the end of the file are zero. readi() and writei()
+// use the page while it exists, so that they and the
+// mappings see each other's changes at once. off must be
+// page-aligned. Returns 0 if memory runs out, the read
+// fails, or off is past the largest file.
+// Caller must hold ip->lock.
+char*
+ipage(struct inode *ip, uint off)
+{
+  uint n = 0;
+
+  if(off < ip->size)
+    n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+  return icache(ip, &ip->pages, off, n);
+}
+
+// Count n more (or, if negative, fewer) processes running
+// ip as their program; writei() and itrunc() refuse while
+// any do. Raising the count from 0 needs ip->lock held,
+// since they check it holding that.
+void
+iexec(struct inode *ip, int n)
+{
+  __sync_fetch_and_add(&ip->nexec, n);
+}
+
+// Drop ip's shared program pages; processes mapping them
+// keep their own references. Caller must hold ip->lock,
+// or hold the last reference to ip.
+void
+itextfree(struct inode *ip)
+{
+  icachefree(&ip->text);
+}
+
+// Drop ip's shared mapping pages, when it is truncated
+// or no longer referenced; mappings keep their own
+// references, but no longer see changes to the file.
+// Caller must hold ip->lock, or hold the last reference.
+void
+ipagesfree(struct inode *ip)
+{
+  icachefree(&ip->pages);
+}
+
 // Directories
 
 int
@@ -633,7 +837,7 @@ namex(char *path, int nameiparent, char *name)
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = idup(myproc()->leader->cwd);
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
@@ -1,6 +1,14 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or with kalloc_pages(), runs of 2^order pages.
+// kmem is a binary buddy allocator: a free block of
+// 2^k pages is aligned to its size, and when freed
+// merges with its buddy, the block it was split from,
+// if that is free too.
+// Each hart keeps a cache of free pages, so that most
+// allocations and frees don't touch the shared kmem.lock;
+// pages move between a cache and kmem in batches.
 
 #include "types.h"
 #include "param.h"
@@ -14,52 +22,223 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PG2PA(i) (KERNBASE + (uint64)(i) * PGSIZE)
+
 struct run {
   struct run *next;
+  struct run **pprev;         // kmem: link pointing at this block
 };
 
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run *free[NORDER];   // free blocks of 2^k pages
+  int nfree[NORDER];
+  char order[NPAGE];          // k if page i starts a free block, else -1
 } kmem;
 
+// references to each page from kalloc(): page tables
+// sharing a copy-on-write page each hold one. atomic.
+// a block from kalloc_pages() counts them in its first
+// page, and its other pages hold TAILREF.
+static int pageref[NPAGE];
+
+#define TAILREF (-1)
+
+#define KCACHEHIGH  64  // a hart's cache spills to kmem above this
+#define KCACHELOW    8  // and refills from kmem below this
+#define KCACHEBATCH 32  // pages moved between a cache and kmem at once
+
+// a hart's free pages. the lock is only contended when
+// another hart, finding kmem empty, steals a page.
+struct kcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+} kcache[NCPU];
+
+// times kalloc() has found no free page; see kshortage().
+static uint kshort;
+
 void
 kinit()
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  memset(kmem.order, -1, sizeof(kmem.order));
+  for(i = 0; i < NCPU; i++)
+    initlock(&kcache[i].lock, "kcache");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Add free block r of 2^k pages to kmem.
+// Caller must hold kmem.lock, as for the rest of these.
+static void
+binsert(struct run *r, int k)
+{
+  r->next = kmem.free[k];
+  if(r->next)
+    r->next->pprev = &r->next;
+  kmem.free[k] = r;
+  r->pprev = &kmem.free[k];
+  kmem.order[PA2PG(r)] = k;
+  kmem.nfree[k]++;
+}
+
+static void
+bremove(struct run *r, int k)
+{
+  *r->pprev = r->next;
+  if(r->next)
+    r->next->pprev = r->pprev;
+  kmem.order[PA2PG(r)] = -1;
+  kmem.nfree[k]--;
+}
+
+// Take a block of 2^order pages, splitting a bigger one
+// if need be and freeing the halves not used.
+static struct run*
+balloc(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k < NORDER && kmem.free[k] == 0; k++)
+    ;
+  if(k == NORDER)
+    return 0;
+  r = kmem.free[k];
+  bremove(r, k);
+  while(k > order){
+    k--;
+    binsert((struct run*)((char*)r + (PGSIZE << k)), k);
+  }
+  return r;
+}
+
+// Free a block of 2^order pages, merging it with its
+// buddy for as long as the buddy is free.
+static void
+bfree(struct run *r, int order)
+{
+  uint64 i = PA2PG(r), b;
+
+  for(; order < NORDER - 1; order++){
+    b = i ^ (1L << order);
+    if(b >= NPAGE || kmem.order[b] != order)
+      break;
+    bremove((struct run*)PG2PA(b), order);
+    i &= ~(1L << order);
+  }
+  binsert((struct run*)PG2PA(i), order);
+}
+
+// Move up to n pages from kmem to kc.
+// Caller must hold kc->lock.
+static void
+refill(struct kcache *kc, int n)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(n-- > 0 && (r = balloc(0)) != 0){
+    r->next = kc->freelist;
+    kc->freelist = r;
+    kc->n++;
+  }
+  release(&kmem.lock);
+}
+
+// Move n pages from kc to kmem.
+// Caller must hold kc->lock, and kc must have n pages.
+static void
+spill(struct kcache *kc, int n)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(n-- > 0){
+    r = kc->freelist;
+    kc->freelist = r->next;
+    kc->n--;
+    bfree(r, 0);
+  }
+  release(&kmem.lock);
+}
+
+// kmem is empty too: take a page from another hart's cache.
+static struct run*
+steal(int self)
+{
+  struct kcache *kc;
+  struct run *r = 0;
+
+  for(kc = kcache; kc < &kcache[NCPU] && r == 0; kc++){
+    if(kc == &kcache[self])
+      continue;
+    acquire(&kc->lock);
+    if((r = kc->freelist) != 0){
+      kc->freelist = r->next;
+      kc->n--;
+    }
+    release(&kc->lock);
+  }
+  return r;
+}
+
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  acquire(&kmem.lock);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    memset(p, 1, PGSIZE);
+    bfree((struct run*)p, 0);
+  }
+  release(&kmem.lock);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last.
+// (The exception is when initializing the allocator;
+// see kinit above.)
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kcache *kc;
+  uint64 i;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
+  // a page of a block from kalloc_pages(), or its first
+  // page, which is followed by the others.
+  i = PA2PG(pa);
+  if(pageref[i] == TAILREF || (i + 1 < NPAGE && pageref[i + 1] == TAILREF))
+    panic("kfree: block");
+
+  if(__sync_sub_and_fetch(&pageref[PA2PG(pa)], 1) > 0)
+    return;
 
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  // interrupts stay off so that we stay on this hart.
+  push_off();
+  kc = &kcache[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  if(++kc->n > KCACHEHIGH)
+    spill(kc, KCACHEBATCH);
+  release(&kc->lock);
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +248,201 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kcache *kc;
+  int id;
+
+  push_off();
+  id = cpuid();
+  kc = &kcache[id];
+  acquire(&kc->lock);
+  // refill before running dry, so that a burst of
+  // allocations seldom waits on kmem.lock.
+  if(kc->n < KCACHELOW)
+    refill(kc, KCACHEBATCH);
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->n--;
+  }
+  release(&kc->lock);
+  if(r == 0)
+    r = steal(id);
+  pop_off();
+
+  if(r){
+    memset((char*)r, 5, PGSIZE); // fill with junk
+    pageref[PA2PG(r)] = 1;
+  } else {
+    __sync_fetch_and_add(&kshort, 1);
+  }
+  return (void*)r;
+}
+
+// How many times kalloc() has run out of memory. Caches
+// of free memory elsewhere in the kernel give it back
+// when this changes; see reclaim().
+uint
+kshortage(void)
+{
+  return __atomic_load_n(&kshort, __ATOMIC_SEQ_CST);
+}
+
+// Add a reference to a page from kalloc(), so that
+// it takes one more kfree() to free it.
+void
+kref(void *pa)
+{
+  __sync_fetch_and_add(&pageref[PA2PG(pa)], 1);
+}
+
+// How many references are there to a page from kalloc()?
+int
+krefs(void *pa)
+{
+  return __atomic_load_n(&pageref[PA2PG(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Returns 0 if there is no such block.
+void *
+kalloc_pages(int order)
+{
+  struct run *r;
+  int i;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order >= NORDER)
+    return 0;
 
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  r = balloc(order);
   release(&kmem.lock);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r){
+    memset((char*)r, 5, PGSIZE << order); // fill with junk
+    pageref[PA2PG(r)] = 1;
+    for(i = 1; i < (1 << order); i++)
+      pageref[PA2PG(r) + i] = TAILREF;
+  }
   return (void*)r;
 }
+
+// Drop a reference to the 2^order pages at pa, which
+// should have been returned by kalloc_pages(order), and
+// free them if that was the last.
+void
+kfree_pages(void *pa, int order)
+{
+  int i;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order >= NORDER || ((uint64)pa % (PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+  for(i = 1; i < (1 << order); i++)
+    if(pageref[PA2PG(pa) + i] != TAILREF)
+      panic("kfree_pages: not a block");
+
+  if(__sync_sub_and_fetch(&pageref[PA2PG(pa)], 1) > 0)
+    return;
+  for(i = 1; i < (1 << order); i++)
+    pageref[PA2PG(pa) + i] = 0;
+
+  memset(pa, 1, PGSIZE << order);
+
+  acquire(&kmem.lock);
+  bfree((struct run*)pa, order);
+  release(&kmem.lock);
+}
+
+#ifdef KALLOC_TEST
+// Free pages, in kmem and the harts' caches.
+static uint64
+nfreepages(void)
+{
+  uint64 n = 0;
+  int k;
+
+  acquire(&kmem.lock);
+  for(k = 0; k < NORDER; k++)
+    n += (uint64)kmem.nfree[k] << k;
+  release(&kmem.lock);
+  for(k = 0; k < NCPU; k++){
+    acquire(&kcache[k].lock);
+    n += kcache[k].n;
+    release(&kcache[k].lock);
+  }
+  return n;
+}
+
+// Check the buddy allocator at boot: take blocks of
+// mixed sizes, check that they are aligned and don't
+// overlap, and that freeing them, in another order,
+// gives every page back. It takes 2^NORDER pages or so,
+// so only kernels built with make KALLOCTEST=1 run it.
+void
+kalloc_test(void)
+{
+  enum { N = 2 * NORDER };
+  char *b[N];
+  int i, j, order[N];
+  uint64 start;
+
+  start = nfreepages();
+  for(i = 0; i < N; i++){
+    // small and big orders, interleaved.
+    order[i] = i % 2 ? NORDER - 1 - i / 2 : i / 2;
+    if((b[i] = kalloc_pages(order[i])) == 0)
+      panic("kalloc_test: out of memory");
+    if((uint64)b[i] % (PGSIZE << order[i]) != 0)
+      panic("kalloc_test: misaligned");
+    for(j = 0; j < i; j++)
+      if(b[i] < b[j] + (PGSIZE << order[j]) && b[j] < b[i] + (PGSIZE << order[i]))
+        panic("kalloc_test: overlap");
+  }
+  if(nfreepages() == start)
+    panic("kalloc_test: nothing allocated");
+  for(i = 0; i < N; i += 2)
+    kfree_pages(b[i], order[i]);
+  for(i = N - 1; i > 0; i -= 2)
+    kfree_pages(b[i], order[i]);
+  if(nfreepages() != start)
+    panic("kalloc_test: pages lost");
+}
+#endif
+
+// Print free memory by block size, and how fragmented
+// it is: the percentage of free pages outside the
+// largest free block, so 0% if all free memory is
+// one block. Pages in the harts' caches count as free
+// but not as part of any block. For ^P on the console.
+void
+kmemdump(void)
+{
+  int k, big = -1, nfree[NORDER];
+  uint64 free = 0, cached = 0;
+
+  acquire(&kmem.lock);
+  for(k = 0; k < NORDER; k++){
+    nfree[k] = kmem.nfree[k];
+    free += (uint64)nfree[k] << k;
+    if(nfree[k])
+      big = k;
+  }
+  release(&kmem.lock);
+  for(k = 0; k < NCPU; k++)
+    cached += kcache[k].n;
+  free += cached;
+
+  printf("free pages %d, %d cached:", (int)free, (int)cached);
+  for(k = 0; k < NORDER; k++)
+    printf(" %d", nfree[k]);
+  if(free)
+    printf(", fragmentation %d%%",
+           big < 0 ? 100 : (int)(100 - (100 << big) / free));
+  printf("\n");
+}
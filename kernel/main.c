@@ -17,16 +17,24 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+#ifdef KALLOC_TEST
+    kalloc_test();   // check the buddy allocator
+#endif
+    slabinit();      // kernel object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
+    sched_init();    // scheduling policies
     trapinit();      // trap vectors
+    timer_init();    // kernel timers
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    vmainit();       // mmap() regions
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -0,0 +1,383 @@
+//
+// Memory mapped by mmap(): anonymous memory, and files.
+//
+// Each region is a struct vma on its process's list, and
+// its pages are mapped on first touch, like those of the
+// heap: zeroed for anonymous memory, or read from the
+// file's inode. A MAP_PRIVATE file region gets private
+// copies of the file's pages. A MAP_SHARED one maps the
+// inode's own page for each offset (see ipage()), the same
+// page in every process mapping the file, which read()
+// and write() use too while it exists. Writable, such a
+// page is mapped read-only until written, so that PTE_D
+// marks the pages to write back to the file, through the
+// log, when the region is unmapped.
+//
+// Regions are placed downward from MMAPTOP, above the
+// heap. The leader's tlock protects its list. Like
+// shrinking the heap, munmap() is refused while threads
+// could still have the pages in their harts' TLBs.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "rbtree.h"
+#include "proc.h"
+
+static struct kmem_cache *vmacache;
+
+void
+vmainit(void)
+{
+  vmacache = kmem_cache_create("vma", sizeof(struct vma));
+}
+
+// Insert v into p's list, which is kept highest first.
+// Caller must hold p->tlock.
+static void
+vmainsert(struct proc *p, struct vma *v)
+{
+  struct vma **pp;
+
+  for(pp = &p->vmas; *pp && (*pp)->start > v->start; pp = &(*pp)->next)
+    ;
+  v->next = *pp;
+  *pp = v;
+}
+
+// Is [start, end) free for a new region of p?
+// Caller must hold p->tlock.
+static int
+vmaroom(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  if(start < PGROUNDUP(p->sz) || end > MMAPTOP || end <= start)
+    return 0;
+  for(v = p->vmas; v; v = v->next)
+    if(start < v->end && end > v->start)
+      return 0;
+  return 1;
+}
+
+// The lowest address mapped by mmap() in p, which the
+// heap must stay below. Caller must hold p->tlock.
+uint64
+vmabase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = MMAPTOP;
+
+  for(v = p->vmas; v; v = v->next)
+    base = v->start;
+  return base;
+}
+
+// The region of p holding va, or 0.
+// Caller must hold p->tlock.
+struct vma*
+vmafind(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v; v = v->next)
+    if(va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Map len bytes of f from off, or zeroed memory if f is 0,
+// at addr if that range is free, or else wherever there
+// is room. Return the address, or -1.
+uint64
+mmap(uint64 addr, uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v, *w;
+  uint64 top;
+
+  if(len == 0 || len > MMAPTOP || addr % PGSIZE != 0 || off % PGSIZE != 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = kmem_cache_alloc(vmacache)) == 0)
+    return -1;
+
+  acquire(&p->tlock);
+  if(addr == 0 || !vmaroom(p, addr, addr + len)){
+    // the highest gap that fits.
+    top = MMAPTOP;
+    for(w = p->vmas; w; w = w->next){
+      if(top - w->end >= len)
+        break;
+      top = w->start;
+    }
+    if(top < len || !vmaroom(p, top - len, top)){
+      release(&p->tlock);
+      kmem_cache_free(vmacache, v);
+      return -1;
+    }
+    addr = top - len;
+  }
+  v->start = addr;
+  v->end = addr + len;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+  vmainsert(p, v);
+  release(&p->tlock);
+  return addr;
+}
+
+// Write n bytes at kernel address src to f at off, a few
+// blocks at a time as filewrite() does, but not past the
+// end of the file. Return -1 if writei() fails, as it
+// does while the file is a running program.
+static int
+writeback(struct file *f, uint64 src, uint off, uint n)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint i, n1;
+  int r;
+
+  for(i = 0; i < n; i += n1){
+    n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+    begin_op();
+    ilock(f->ip);
+    if(off + i >= f->ip->size){
+      iunlock(f->ip);
+      end_op();
+      break;
+    }
+    if(n1 > f->ip->size - (off + i))
+      n1 = f->ip->size - (off + i);
+    r = writei(f->ip, 0, src + i, off + i, n1);
+    iunlock(f->ip);
+    end_op();
+    if(r != n1)
+      return -1;
+  }
+  return 0;
+}
+
+// Write the dirty pages of v in [start, end) back to its
+// file, if v is a shared, writable file mapping. Return -1
+// if a page can't be written.
+static int
+vmasync(pagetable_t pagetable, struct vma *v, uint64 start, uint64 end)
+{
+  uint64 va;
+  pte_t *pte;
+
+  if(v->f == 0 || (v->flags & MAP_SHARED) == 0 || (v->prot & PROT_WRITE) == 0)
+    return 0;
+  for(va = start; va < end; va += PGSIZE){
+    if((pte = walk(pagetable, va, 0)) != 0 && (*pte & (PTE_V|PTE_D)) == (PTE_V|PTE_D) &&
+       writeback(v->f, PTE2PA(*pte), v->off + (va - v->start), PGSIZE) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Unmap [addr, addr+len) from the current process, writing
+// shared file pages back first. Parts of regions may be
+// unmapped, splitting a region in two if need be.
+// Return -1 if addr isn't page-aligned, if the process
+// has threads, or if shared pages can't be written back,
+// in which case the region that failed stays mapped.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc()->leader;
+  struct vma **pp, *v, *w;
+  uint64 end, lo, hi;
+
+  if(addr % PGSIZE != 0 || len == 0 || addr + len < addr)
+    return -1;
+  end = PGROUNDUP(addr + len);
+  if(p->threads)
+    return -1;
+
+  for(pp = &p->vmas; (v = *pp) != 0; ){
+    if(v->end <= addr || v->start >= end){
+      pp = &v->next;
+      continue;
+    }
+    lo = v->start > addr ? v->start : addr;
+    hi = v->end < end ? v->end : end;
+    w = 0;
+    if(lo > v->start && hi < v->end && (w = kmem_cache_alloc(vmacache)) == 0)
+      return -1;
+
+    if(vmasync(p->pagetable, v, lo, hi) < 0){
+      if(w)
+        kmem_cache_free(vmacache, w);
+      return -1;
+    }
+    uvmunmap(p->pagetable, lo, (hi - lo) / PGSIZE, 1);
+
+    acquire(&p->tlock);
+    if(lo == v->start && hi == v->end){
+      *pp = v->next;
+      release(&p->tlock);
+      if(v->f)
+        fileclose(v->f);
+      kmem_cache_free(vmacache, v);
+      continue;
+    }
+    if(lo == v->start){
+      v->off += hi - v->start;
+      v->start = hi;
+    } else if(hi == v->end){
+      v->end = lo;
+    } else {
+      // a hole in the middle: w takes the part above it.
+      *w = *v;
+      w->start = hi;
+      w->off += hi - v->start;
+      w->f = v->f ? filedup(v->f) : 0;
+      v->end = lo;
+      vmainsert(p, w);
+    }
+    release(&p->tlock);
+    pp = &v->next;
+  }
+  return 0;
+}
+
+// Map a page at va in region v of p, touched for the first
+// time by access (see pagefault()): zeroed, or read from
+// the file. Called and returns with p->tlock held, but
+// releases it while reading. Return -1 if v's protection
+// forbids the access, or memory runs out.
+int
+vmafault(struct proc *p, struct vma *v, uint64 va, int access)
+{
+  struct inode *ip;
+  pte_t *pte;
+  char *mem;
+  uint off;
+  int perm, locked;
+
+  if(v->prot == PROT_NONE ||
+     (access == PTE_W && (v->prot & PROT_WRITE) == 0) ||
+     (access == PTE_X && (v->prot & PROT_EXEC) == 0))
+    return -1;
+  perm = PTE_U | PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W | PTE_D;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  // a shared file page is clean until written; see
+  // vmasync() and pagefault().
+  if(v->f && (v->flags & MAP_SHARED) && access != PTE_W)
+    perm &= ~(PTE_W | PTE_D);
+
+  if(v->f == 0){
+    if((mem = kalloc()) == 0)
+      return -1;
+    memset(mem, 0, PGSIZE);
+  } else {
+    ip = v->f->ip;
+    off = v->off + (va - v->start);
+    release(&p->tlock);
+    // as in execload().
+    if((locked = holdingsleep(&ip->lock)) == 0)
+      ilock(ip);
+    if(v->flags & MAP_SHARED)
+      mem = ipage(ip, off);
+    else if((mem = kalloc()) != 0){
+      memset(mem, 0, PGSIZE);
+      if(off < ip->size)
+        readi(ip, 0, (uint64)mem, off, ip->size - off < PGSIZE ? ip->size - off : PGSIZE);
+    }
+    if(!locked)
+      iunlock(ip);
+    acquire(&p->tlock);
+    if(mem == 0)
+      return -1;
+    // another thread may have read it in meanwhile.
+    if((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+      kfree(mem);
+      sfence_vma();
+      return 0;
+    }
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Give np a copy of each of p's regions, copy-on-write
+// if cow is set; see uvmcopy(). np maps the pages of
+// shared file regions from the inode when it touches
+// them. Return -1 if memory runs out. Caller must hold
+// p->tlock.
+int
+vmacopy(struct proc *p, struct proc *np, int cow)
+{
+  struct vma *v, *w, **tail = &np->vmas;
+
+  for(v = p->vmas; v; v = v->next){
+    if((w = kmem_cache_alloc(vmacache)) == 0)
+      return -1;
+    *w = *v;
+    w->next = 0;
+    if(w->f)
+      filedup(w->f);
+    *tail = w;
+    tail = &w->next;
+    if(w->f && (w->flags & MAP_SHARED))
+      continue;
+    if(uvmcopy(p->pagetable, np->pagetable, v->start, v->end, cow) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Copy the shared copy-on-write pages of p's regions,
+// before its page table is shared by threads. Caller must hold
+// p->tlock.
+int
+vmaunshare(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v; v = v->next)
+    if(uvmunshare(p->pagetable, v->start, v->end) < 0)
+      return -1;
+  return 0;
+}
+
+// Unmap all of p's regions, for exit() and exec(). If
+// sync is set, shared file pages are written back first,
+// which sleeps. Return -1 if that fails, leaving the
+// region that failed and those after it mapped.
+int
+vmaclear(struct proc *p, int sync)
+{
+  struct vma *v;
+
+  while((v = p->vmas) != 0){
+    if(sync && vmasync(p->pagetable, v, v->start, v->end) < 0)
+      return -1;
+    uvmunmap(p->pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+    p->vmas = v->next;
+    if(v->f)
+      fileclose(v->f);
+    kmem_cache_free(vmacache, v);
+  }
+  return 0;
+}
@@ -1,15 +1,22 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC      4096  // maximum number of processes
+#define NKSTACKCACHE  8  // free kernel stacks cached per CPU
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NTHREAD      32  // maximum threads per process
+#define NSEG          4  // loadable segments per executable
+#define MAXPREFAULT 128  // most pages prefault() reads in for one copy
+#define NINODE       50  // i-nodes cached beyond those in use
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NORDER       11  // buddy allocator block sizes: 2^0 to 2^10 pages
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
-#define QUANTUM      5     // time quantum for each running process
-#define ALPHA        50    // alpha parameter for estimated burst time
+#define QUANTUM      5     // time slice of a NORMAL priority process, in ticks
+#define TICKCYCLES   1000000 // cycles per clock tick; about 1/10th second in qemu
+#define ALPHA        50    // weight in percent of the newest burst in the burst prediction
+#define NSCHED       6     // number of scheduling policies
+#define NMLFQ        4     // number of MLFQ levels
@@ -0,0 +1,12 @@
+// Process statistics returned by wait_stat().
+struct perf {
+  int ctime;                  // Process creation time
+  int ttime;                  // Process termination time
+  int stime;                  // The total time the process spent in the SLEEPING mode
+  int retime;                 // The total time the process spent in the RUNNABLE mode
+  int rutime;                 // The total time the process spent in the RUNNING mode
+  int average_bursttime;      // Predicted burst length, in 100ths of a tick
+  int migrations;             // Times the process moved to another cpu
+  int leveltime[NMLFQ];       // Time spent running at each MLFQ level
+  int misses;                 // EDF jobs still running past their deadline
+};
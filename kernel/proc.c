@@ -3,8 +3,12 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
+#include "perf.h"
+#include "sched.h"
 #include "defs.h"
+#include "fcntl.h"
 #include "syscall.h"
 
 #include <stdarg.h>
@@ -12,37 +16,254 @@
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
-
 struct proc *initproc;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// Processes in use, hashed by pid, so that kill() and
+// friends needn't search the table. Protected by pid_lock.
+#define NPIDHASH 64
+struct proc *pidhash[NPIDHASH];
+
+// Processes are allocated a page of them at a time (see
+// procslab()). allpages lists every page; freepages those
+// with UNUSED procs, which each page keeps on a stack
+// linked through p->nextfree. free_lock protects the
+// lists, the pages' stacks and counts, and nproc, the
+// number of procs in use.
+//
+// A page whose procs are all UNUSED goes back to kalloc,
+// but only once nothing can still be looking at them:
+// findproc() and walkers of allpages count themselves in
+// procwalkers while they might hold a pointer to an
+// UNUSED proc, and the last holder of each proc's lock
+// must have let go (see procreclaim()).
+struct procpage {
+  struct procpage *next;       // Next in allpages
+  struct procpage **pprev;     // Link pointing at this page
+  struct procpage *freenext;   // Next in freepages, or in deadpages
+  struct procpage **freepprev; // Link pointing at this page; 0 if full
+  struct proc *free;           // UNUSED procs on this page
+  int nused;                   // Procs in use
+  struct proc procs[];
+};
+
+#define NPROCPAGE ((PGSIZE - sizeof(struct procpage)) / sizeof(struct proc))
+#define PROCPAGE(p) ((struct procpage*)PGROUNDDOWN((uint64)(p)))
+
+struct spinlock free_lock;
+struct procpage *allpages;
+struct procpage *freepages;
+struct procpage *deadpages;    // Empty, waiting to be freed
+int procwalkers;
+int nproc;
+
+// Kernel stacks. A stack is a page mapped at KSTACK(n) for
+// slot n, above an invalid guard page. A freed stack goes
+// to its cpu's cache, or when that is full, is unmapped,
+// and its slot goes on freekslots for a new page to be
+// mapped there. kstack_lock protects freekslots and the
+// making of new stacks.
+struct spinlock kstack_lock;
+uint64 freekslots[NPROC];
+int nfreekslot;
+int nkstack;
+uint kstackgen;  // Bumped each time a stack is mapped.
+
+extern pagetable_t kernel_pagetable;
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void killproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
+// Sleeping processes, hashed by wait channel, so that
+// wakeup() only looks at processes that might be
+// sleeping on its channel.
+#define SLEEPQBITS 6
+#define NSLEEPQ (1 << SLEEPQBITS)
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl) {
+// Return a kernel stack: from this cpu's cache if it has
+// one, else from the free list, else a new page mapped at
+// the next free KSTACK slot. Returns 0 if out of memory.
+static uint64
+kstackalloc(void)
+{
+  struct cpu *c;
+  uint64 va;
+  char *pa;
+
+  push_off();
+  c = mycpu();
+  if(c->nkstack > 0){
+    va = c->kstacks[--c->nkstack];
+    pop_off();
+    return va;
+  }
+  pop_off();
+
+  acquire(&kstack_lock);
+  if((pa = kalloc()) == 0){
+    release(&kstack_lock);
+    return 0;
+  }
+  va = nfreekslot > 0 ? freekslots[nfreekslot - 1] : KSTACK(nkstack);
+  if(mappages(kernel_pagetable, va, PGSIZE, (uint64)pa, PTE_R | PTE_W) < 0){
+    kfree(pa);
+    release(&kstack_lock);
+    return 0;
+  }
+  if(nfreekslot > 0)
+    nfreekslot--;
+  else
+    nkstack++;
+  // other harts catch up in scheduler(), flushing any
+  // mapping a reused slot had before.
+  sfence_vma();
+  kstackgen++;
+  release(&kstack_lock);
+  return va;
+}
+
+// Give the page of the stack at va back to kalloc(),
+// and its slot to freekslots.
+static void
+kstackunmap(uint64 va)
+{
+  // harts that ran on the stack may still have it in
+  // their TLBs, but won't use va again until it is
+  // mapped anew, bumping kstackgen.
+  acquire(&kstack_lock);
+  uvmunmap(kernel_pagetable, va, 1, 1);
+  sfence_vma();
+  freekslots[nfreekslot++] = va;
+  release(&kstack_lock);
+}
+
+static void
+kstackfree(uint64 va)
+{
+  struct cpu *c;
+
+  push_off();
+  c = mycpu();
+  if(c->nkstack < NKSTACKCACHE){
+    c->kstacks[c->nkstack++] = va;
+    pop_off();
+    return;
+  }
+  pop_off();
+  kstackunmap(va);
+}
+
+static void
+freepages_insert(struct procpage *pg)
+{
+  pg->freenext = freepages;
+  if(freepages)
+    freepages->freepprev = &pg->freenext;
+  freepages = pg;
+  pg->freepprev = &freepages;
+}
+
+static void
+freepages_remove(struct procpage *pg)
+{
+  *pg->freepprev = pg->freenext;
+  if(pg->freenext)
+    pg->freenext->freepprev = pg->freepprev;
+  pg->freenext = 0;
+  pg->freepprev = 0;
+}
+
+// Carve a fresh page into procs.
+// Caller must hold free_lock.
+static int
+procslab(void)
+{
+  struct procpage *pg;
   struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+
+  if((pg = kalloc()) == 0)
+    return -1;
+  memset(pg, 0, PGSIZE);
+  for(p = pg->procs; p < &pg->procs[NPROCPAGE]; p++){
+    initlock(&p->lock, "proc");
+    initlock(&p->tlock, "threads");
+    p->nextfree = pg->free;
+    pg->free = p;
+  }
+  freepages_insert(pg);
+  pg->next = allpages;
+  if(allpages)
+    allpages->pprev = &pg->next;
+  pg->pprev = &allpages;
+  // procdump() and sched_setpolicy() walk allpages
+  // without free_lock; publish pg only once it's set up.
+  __sync_synchronize();
+  allpages = pg;
+  return 0;
+}
+
+// Pages of empty procs may be freed only while nothing is
+// between procwalk() and procunwalk().
+static void
+procwalk(void)
+{
+  __sync_fetch_and_add(&procwalkers, 1);
+}
+
+static void
+procunwalk(void)
+{
+  __sync_fetch_and_sub(&procwalkers, 1);
+}
+
+// Give pages whose procs are all UNUSED back to kalloc.
+// A page is first taken off allpages, so no new walker
+// finds it; it is freed once no walker remains that
+// might have found it before, and whoever held each of
+// its procs' locks last (in freeproc()'s caller) has
+// released it. Caller must hold free_lock.
+static void
+procreclaim(void)
+{
+  struct procpage *pg, **pp;
+  struct proc *p;
+  int held;
+
+  __sync_synchronize();
+  if(deadpages == 0 || procwalkers > 0)
+    return;
+  for(pp = &deadpages; (pg = *pp) != 0; ){
+    held = 0;
+    for(p = pg->procs; p < &pg->procs[NPROCPAGE]; p++)
+      held |= holding(&p->lock);
+    if(held){
+      // this cpu freed one of them, and holds its lock.
+      pp = &pg->freenext;
+      continue;
+    }
+    // wait for other cpus' holders; UNUSED procs can't
+    // be found again to be locked anew.
+    for(p = pg->procs; p < &pg->procs[NPROCPAGE]; p++){
+      acquire(&p->lock);
+      release(&p->lock);
+    }
+    *pp = pg->freenext;
+    kfree(pg);
   }
 }
 
@@ -50,14 +271,17 @@ proc_mapstacks(pagetable_t kpgtbl) {
 void
 procinit(void)
 {
-  struct proc *p;
+  struct cpu *c;
+  int i;
   
   initlock(&pid_lock, "nextpid");
+  initlock(&free_lock, "freeprocs");
+  initlock(&kstack_lock, "kstack");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  for(c = cpus; c < &cpus[NCPU]; c++)
+      initlock(&c->runq.lock, "runq");
+  for(i = 0; i < NSLEEPQ; i++)
+      initlock(&sleepq[i].lock, "sleepq");
 }
 
 // Must be called with interrupts disabled,
@@ -89,56 +313,355 @@ myproc(void) {
   return p;
 }
 
+// Give p a new pid, and enter it in the pid hash.
 int
-allocpid() {
+allocpid(struct proc *p) {
   int pid;
+  struct proc **pp;
   
   acquire(&pid_lock);
   pid = nextpid;
   nextpid = nextpid + 1;
+  p->pid = pid;
+  pp = &pidhash[pid % NPIDHASH];
+  p->pidnext = *pp;
+  if(*pp)
+    (*pp)->pidpprev = &p->pidnext;
+  *pp = p;
+  p->pidpprev = pp;
   release(&pid_lock);
 
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// Take p out of the pid hash.
+static void
+freepid(struct proc *p)
+{
+  acquire(&pid_lock);
+  *p->pidpprev = p->pidnext;
+  if(p->pidnext)
+    p->pidnext->pidpprev = p->pidpprev;
+  p->pidnext = 0;
+  p->pidpprev = 0;
+  release(&pid_lock);
+}
+
+// Return the process with the given pid, with p->lock
+// held, or 0 if there is none. The hash is searched
+// without p->lock, which must not be taken while holding
+// pid_lock (see freeproc()), so check p once locked: it
+// may have been freed in between.
 static struct proc*
-allocproc(void)
+findproc(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
+  // p's page mustn't be freed before p is checked.
+  procwalk();
+  acquire(&pid_lock);
+  for(p = pidhash[pid % NPIDHASH]; p; p = p->pidnext)
+    if(p->pid == pid)
+      break;
+  release(&pid_lock);
+  if(p == 0){
+    procunwalk();
+    return 0;
+  }
+  acquire(&p->lock);
+  procunwalk();
+  if(p->pid != pid || p->state == UNUSED){
+    release(&p->lock);
+    return 0;
+  }
+  return p;
+}
+
+// Should p, just made RUNNABLE, preempt curr rather than
+// wait for curr's turn to end? A realtime process always
+// preempts one of another policy. Otherwise, only if they
+// share a policy and that policy ranks processes; policies
+// otherwise take turns on the cpu.
+static int
+preempts(struct proc *p, struct proc *curr)
+{
+  struct sched_class *sc = sched_class[p->policy];
+
+  if(p->policy != curr->policy)
+    return sc->realtime && !sched_class[curr->policy]->realtime;
+  return sc->preempt && sc->preempt(p, curr);
+}
+
+// p has just been queued on c: make sure some hart will
+// notice. If c is halted in idle(), wake it. If c is busy
+// running something else, wake an idle hart to steal p;
+// failing that, if p should preempt c's process, ask c to
+// reschedule now instead of at the end of its time slice.
+static void
+runq_kick(struct cpu *c, struct proc *p)
+{
+  struct cpu *v;
+  struct proc *curr;
+
+  if(c->idle){
+    ipi(c - cpus);
+    return;
+  }
+  // c may be done with curr, which may exit and be freed
+  // meanwhile, so keep its page from being reclaimed;
+  // looking at it without its lock is only a hint.
+  procwalk();
+  curr = c->proc;
+  if(curr == 0 || curr == p){
+    procunwalk();
+    return;
+  }
+  for(v = cpus; v < &cpus[NCPU]; v++){
+    if(v->started && v->idle){
+      procunwalk();
+      ipi(v - cpus);
+      return;
     }
   }
-  return 0;
+  if(preempts(p, curr)){
+    c->resched = 1;
+    ipi(c - cpus);
+  }
+  procunwalk();
+}
+
+// Has another hart asked this one to give up the cpu,
+// for a process it woke (see runq_kick())?
+int
+resched(void)
+{
+  int r;
+
+  push_off();
+  r = mycpu()->resched;
+  pop_off();
+  return r;
+}
+
+// Put p on the run queue of p->cpu.
+// Caller must hold p->lock, and p must be RUNNABLE.
+static void
+runq_add(struct proc *p)
+{
+  struct runq *rq = &p->cpu->runq;
+
+  acquire(&rq->lock);
+  sched_class[p->policy]->enqueue(rq, p);
+  p->queued = 1;
+  rq->len++;
+  release(&rq->lock);
+
+  runq_kick(p->cpu, p);
+}
+
+// Take the next process off c's run queue. Realtime
+// policies come first; the others take turns.
+// Returns 0 if the queue is empty.
+// Caller must hold c->runq.lock.
+static struct proc*
+runq_take(struct cpu *c)
+{
+  struct runq *rq = &c->runq;
+  struct proc *p = 0;
+  int i, policy;
+
+  for(policy = 0; policy < NSCHED && p == 0 && rq->len > 0; policy++)
+    if(sched_class[policy]->realtime)
+      p = sched_class[policy]->pick_next(rq);
+  for(i = 0; i < NSCHED && p == 0 && rq->len > 0; i++){
+    policy = (rq->next + i) % NSCHED;
+    if(!sched_class[policy]->realtime &&
+       (p = sched_class[policy]->pick_next(rq)) != 0)
+      rq->next = (policy + 1) % NSCHED;
+  }
+  if(p){
+    p->queued = 0;
+    rq->len--;
+  }
+  return p;
+}
+
+static struct proc*
+runq_pop(struct cpu *c)
+{
+  struct proc *p;
+
+  acquire(&c->runq.lock);
+  p = runq_take(c);
+  release(&c->runq.lock);
+  return p;
+}
+
+// Called by an idle cpu c to take work from the busiest
+// other cpu. A victim must have something to give: either
+// two or more queued processes, or one queued behind the
+// process it is running. Lengths are read without locks
+// to pick the victim. Both queues are locked, in address
+// order, while the process moves, so that its policy sees
+// both as they are (see cfs_migrate()).
+// Returns the process the victim would have run next.
+static struct proc*
+runq_steal(struct cpu *c)
+{
+  struct cpu *v, *victim = 0, *first, *second;
+  struct proc *p;
+  int len, maxlen = 0;
+
+  for(v = cpus; v < &cpus[NCPU]; v++){
+    if(v == c || !v->started)
+      continue;
+    len = v->runq.len;
+    if(len == 0 || (len == 1 && v->proc == 0))
+      continue;
+    if(len > maxlen){
+      victim = v;
+      maxlen = len;
+    }
+  }
+  if(victim == 0)
+    return 0;
+  first = c < victim ? c : victim;
+  second = c < victim ? victim : c;
+  acquire(&first->runq.lock);
+  acquire(&second->runq.lock);
+  p = runq_take(victim);
+  if(p && sched_class[p->policy]->migrate)
+    sched_class[p->policy]->migrate(p, &victim->runq, &c->runq);
+  release(&second->runq.lock);
+  release(&first->runq.lock);
+  return p;
+}
+
+// Choose a cpu for a new process: the running cpu
+// with the least work, counting its current process.
+// The lengths are read without locks; it's only a hint.
+static struct cpu*
+leastloaded(void)
+{
+  struct cpu *c, *best = 0;
+  int load, bestload = 0;
+
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(!c->started)
+      continue;
+    load = c->runq.len + (c->proc != 0);
+    if(best == 0 || load < bestload){
+      best = c;
+      bestload = load;
+    }
+  }
+  return best;
+}
+
+// ALPHA as a 16.16 fixed-point fraction, for the
+// exponential average of burst lengths in sleep().
+#define ALPHA_Q16 ((ALPHA << 16) / 100)
+
+// Charge the time since p's last state change to the
+// state it is in, and return the cycles charged. Called
+// just before every change of p->state, so the totals are
+// exact rather than sampled once per tick.
+// Caller must hold p->lock.
+static uint64
+account(struct proc *p)
+{
+  uint64 now = r_time();
+  uint64 delta = now - p->tstamp;
+
+  if(p->state == SLEEPING)
+    p->stime += delta;
+  else if(p->state == RUNNABLE)
+    p->retime += delta;
+  else if(p->state == RUNNING)
+    p->rutime += delta;
+  p->tstamp = now;
+  return delta;
+}
+
+// Take an UNUSED proc off the free stack, making more if need be.
+// If there is one, initialize state required to run in the kernel,
+// and return with p->lock held. If leader is not 0, p is a thread
+// of leader, sharing its page table; otherwise p gets its own.
+// If there are NPROC procs in use, or a memory allocation fails, return 0.
+static struct proc*
+allocproc(struct proc *leader)
+{
+  int slot;
+  struct proc *p;
+  struct procpage *pg;
+
+  acquire(&free_lock);
+  if(nproc >= NPROC || (freepages == 0 && procslab() < 0) ||
+     srt_reserve(nproc + 1) < 0){
+    release(&free_lock);
+    return 0;
+  }
+  pg = freepages;
+  p = pg->free;
+  pg->free = p->nextfree;
+  if(pg->free == 0)
+    freepages_remove(pg);
+  pg->nused++;
+  nproc++;
+  procreclaim();
+  release(&free_lock);
 
-found:
-  p->pid = allocpid();
+  acquire(&p->lock);
+  allocpid(p);
   p->state = USED;
 
-  // Allocate a trapframe page.
-  if((p->trapframe = (struct trapframe *)kalloc()) == 0){
+  // Allocate a kernel stack.
+  if((p->kstack = kstackalloc()) == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
+  // Allocate a trapframe page.
+  if((p->trapframe = (struct trapframe *)kalloc()) == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
   }
 
+  if(leader){
+    // map the trapframe in the next free slot below
+    // the leader's, which has slot 0.
+    p->leader = leader;
+    p->pagetable = leader->pagetable;
+    acquire(&leader->tlock);
+    for(slot = 1; slot < NTHREAD; slot++)
+      if((leader->tslots & (1 << slot)) == 0)
+        break;
+    if(slot == NTHREAD ||
+       mappages(p->pagetable, TRAPFRAME - slot*PGSIZE, PGSIZE,
+                (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
+      release(&leader->tlock);
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    leader->tslots |= 1 << slot;
+    p->trapva = TRAPFRAME - slot*PGSIZE;
+    release(&leader->tlock);
+  } else {
+    // An empty user page table.
+    p->leader = p;
+    p->pagetable = proc_pagetable(p);
+    if(p->pagetable == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->trapva = TRAPFRAME;
+    p->tslots = 1;
+  }
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -153,33 +676,87 @@ found:
   p->stime = 0;
   p->retime = 0;
   p->rutime = 0;
-  p->average_bursttime = QUANTUM * 100;
-
-  p->current_bursttime = 0;
+  p->tstamp = r_time();
+  p->burst = 0;
+  p->burst_pred = QUANTUM * TICKCYCLES;
   p->priority = NORMAL;
+  p->migrations = 0;
+  p->vruntime = 0;
+  memset(p->leveltime, 0, sizeof(p->leveltime));
+  p->dl_bw = 0;
+  p->throttled = 0;
+  p->misses = 0;
+  p->policy = sched_default;
   return p;
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages, unless p is a thread: those
+// belong to its leader, which must outlive it.
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
 {
-  if(p->trapframe)
-    kfree((void*)p->trapframe);
-  p->trapframe = 0;
-  if(p->pagetable)
+  struct proc *leader = p->leader;
+  struct procpage *pg;
+
+  if(leader && leader != p && p->trapva){
+    acquire(&leader->tlock);
+    uvmunmap(p->pagetable, p->trapva, 1, 0);
+    leader->tslots &= ~(1 << (TRAPFRAME - p->trapva) / PGSIZE);
+    release(&leader->tlock);
+  } else if(leader == p && p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  p->trapva = 0;
+  p->leader = 0;
+  p->tslots = 0;
   p->sz = 0;
+  if(p->trapframe)
+    kfree((void*)p->trapframe);
+  p->trapframe = 0;
+  if(p->kstack)
+    kstackfree(p->kstack);
+  p->kstack = 0;
+  if(p->pidpprev)
+    freepid(p);
   p->pid = 0;
+  if(p->sibpprev){
+    // on its parent's child list, or its leader's thread
+    // list; caller holds wait_lock.
+    *p->sibpprev = p->sibnext;
+    if(p->sibnext)
+      p->sibnext->sibpprev = p->sibpprev;
+    p->sibnext = 0;
+    p->sibpprev = 0;
+  }
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+
+  acquire(&free_lock);
+  pg = PROCPAGE(p);
+  p->nextfree = pg->free;
+  pg->free = p;
+  if(pg->freepprev == 0)
+    freepages_insert(pg);
+  if(--pg->nused == 0){
+    freepages_remove(pg);
+    *pg->pprev = pg->next;
+    if(pg->next)
+      pg->next->pprev = pg->pprev;
+    // walkers on pg may still follow pg->next.
+    pg->pprev = 0;
+    pg->freenext = deadpages;
+    deadpages = pg;
+  }
+  nproc--;
+  srt_shrink(nproc);
+  procreclaim();
+  release(&free_lock);
 }
 
 // Create a user page table for a given process,
@@ -243,7 +820,7 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy init's instructions
@@ -258,29 +835,187 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
+  // no cpu has started scheduling yet; queue it here.
+  p->cpu = mycpu();
+  account(p);
   p->state = RUNNABLE;
+  runq_add(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
+// Growing only moves sz; pagefault() maps each new
+// page when first touched.
+// Return the old size, so that threads growing memory at
+// once each learn where their own part starts, or -1 on
+// failure.
+uint64
 growproc(int n)
 {
-  uint sz;
-  struct proc *p = myproc();
+  uint64 sz, oldsz;
+  struct execseg *s;
+  struct proc *p = myproc()->leader;
 
-  sz = p->sz;
+  acquire(&p->tlock);
+  sz = oldsz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // stay below mmap() regions and the threads' trapframes,
+    // and don't promise more memory than the machine has:
+    // fork(), exit() and uvmunmap() walk every page of it.
+    if(sz + n > vmabase(p) || sz + n > PHYSTOP - KERNBASE){
+      release(&p->tlock);
       return -1;
     }
+    sz += n;
   } else if(n < 0){
+    // other threads may still have the pages in their
+    // harts' TLBs, so don't free them for reuse.
+    if(p->threads){
+      release(&p->tlock);
+      return -1;
+    }
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // memory grown back later must come back zeroed,
+    // not reloaded from the executable.
+    for(s = p->seg; s < &p->seg[p->nseg]; s++){
+      if(s->va >= PGROUNDUP(sz))
+        s->filesz = 0;
+      else if(s->va + s->filesz > PGROUNDUP(sz))
+        s->filesz = PGROUNDUP(sz) - s->va;
+      else
+        continue;
+      s->text = 0;  // no longer matches the shared pages
+    }
   }
   p->sz = sz;
-  return 0;
+  release(&p->tlock);
+  return oldsz;
+}
+
+// Read page va of segment s of p's program in from its
+// executable and map it. Called and returns with p->tlock
+// held, but releases it while reading.
+static int
+pagein(struct proc *p, struct execseg *s, uint64 va)
+{
+  pte_t *pte;
+  char *mem;
+  int perm, r = -1;
+
+  perm = s->text ? PTE_R|PTE_X|PTE_U : PTE_W|PTE_X|PTE_R|PTE_U;
+  release(&p->tlock);
+  mem = execload(p, s, va);
+  acquire(&p->tlock);
+  if(mem == 0)
+    return -1;
+
+  // another thread may have read it in meanwhile, or
+  // shrunk memory.
+  if(va >= p->sz){
+    kfree(mem);
+  } else if((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    kfree(mem);
+    sfence_vma();
+    r = 0;
+  } else if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+  } else {
+    r = 0;
+  }
+  return r;
+}
+
+// Handle a page fault at va in the current process, or
+// an access by copyin() or copyout() to pagetable that
+// might fault. access is PTE_R, PTE_W or PTE_X, for a
+// load, a store or an instruction fetch. Read the page in from the
+// program's executable if exec() left it for later, map
+// a zeroed page if va is in memory grown by sbrk() that
+// nothing has touched yet, or copy a copy-on-write page
+// being written.
+// Return -1 if va isn't mapped and can't be, if the page
+// doesn't allow the access, or if memory runs out.
+int
+pagefault(pagetable_t pagetable, uint64 va, int access)
+{
+  struct proc *p = myproc()->leader;
+  struct execseg *s;
+  struct vma *v = 0;
+  pte_t *pte;
+  int r = -1;
+
+  if(pagetable != p->pagetable)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  // threads may fault on the same page at once.
+  acquire(&p->tlock);
+  if(va < p->sz || (v = vmafind(p, va)) != 0){
+    pte = walk(pagetable, va, 0);
+    if((pte == 0 || (*pte & PTE_V) == 0) && va >= p->sz){
+      // files too are read with interrupts on.
+      if(v->f == 0 || intr_get())
+        r = vmafault(p, v, va, access);
+    } else if((pte == 0 || (*pte & PTE_V) == 0) && (s = execseg(p, va)) != 0){
+      // reading the file sleeps, which a caller holding
+      // a spinlock (and so with interrupts off) can't;
+      // see prefault(). text is read-only.
+      if(intr_get() && !(access == PTE_W && s->text))
+        r = pagein(p, s, va);
+    } else if(pte == 0 || (*pte & PTE_V) == 0)
+      r = uvmlazy(pagetable, va);
+    else if(access == PTE_W && (*pte & PTE_COW))
+      r = uvmcow(pagetable, va);
+    else if(access == PTE_W && v && v->f && (v->flags & MAP_SHARED) &&
+            (v->prot & PROT_WRITE) && (*pte & PTE_U)){
+      // first write to a clean shared file page.
+      *pte |= PTE_W | PTE_D;
+      sfence_vma();
+      r = 0;
+    }
+    else if((*pte & PTE_U) && (*pte & access)){
+      // another thread mapped it first.
+      sfence_vma();
+      r = 0;
+    }
+  }
+  release(&p->tlock);
+  return r;
+}
+
+// Read in any pages of [addr, addr+n) that exec() left
+// in the executable, or mmap() in a file, ahead of a
+// copyin() or copyout() done holding a spinlock or an
+// inode's lock. Only the first MAXPREFAULT pages are
+// read in; a copy reaching past them that needs a file
+// page comes up short.
+void
+prefault(uint64 addr, int n)
+{
+  struct proc *p = myproc()->leader;
+  uint64 va, end;
+  pte_t *pte;
+  int load;
+
+  if(n <= 0)
+    return;
+  end = addr + n;
+  if(end > PGROUNDDOWN(addr) + MAXPREFAULT*PGSIZE)
+    end = PGROUNDDOWN(addr) + MAXPREFAULT*PGSIZE;
+  for(va = PGROUNDDOWN(addr); va < end && va < MMAPTOP; va += PGSIZE){
+    acquire(&p->tlock);
+    pte = walk(p->pagetable, va, 0);
+    if(pte && (*pte & PTE_V))
+      load = 0;
+    else if(va < p->sz)
+      load = execseg(p, va) != 0;
+    else
+      load = vmafind(p, va) != 0;
+    release(&p->tlock);
+    if(load)
+      pagefault(p->pagetable, va, PTE_R);
+  }
 }
 
 // Create a new process, copying the parent.
@@ -291,19 +1026,31 @@ fork(void)
   int i, pid;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *leader = p->leader;
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child, lazily unless
+  // the parent has threads; see uvmcow().
+  acquire(&leader->tlock);
+  if(uvmcopy(p->pagetable, np->pagetable, 0, leader->sz, leader->threads == 0) < 0){
+    release(&leader->tlock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  // so that freeproc() frees the heap if vmacopy() fails.
+  np->sz = leader->sz;
+  if(vmacopy(leader, np, leader->threads == 0) < 0){
+    release(&leader->tlock);
+    vmaclear(np, 0);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -313,61 +1060,119 @@ fork(void)
 
   // increment reference counts on open file descriptors.
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+    if(leader->ofile[i])
+      np->ofile[i] = filedup(leader->ofile[i]);
+  release(&leader->tlock);
+  np->cwd = idup(leader->cwd);
+  if(leader->exe){
+    np->exe = idup(leader->exe);
+    iexec(np->exe, 1);
+  }
+  memmove(np->seg, leader->seg, sizeof(leader->seg));
+  np->nseg = leader->nseg;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   // the child copies the mask of the parent
   np->mask = p->mask;
 
-  // the child proccess has the priority of the father
   pid = np->pid;
 
   release(&np->lock);
 
   acquire(&wait_lock);
   np->parent = p;
+  np->sibnext = p->child;
+  if(p->child)
+    p->child->sibpprev = &np->sibnext;
+  p->child = np;
+  np->sibpprev = &p->child;
   release(&wait_lock);
 
   acquire(&np->lock);
+  // the child proccess has the priority of the father
   np->priority = p->priority;
-  release(&np->lock);
-
-  acquire(&np->lock);
+  // EDF bandwidth was admitted for p alone.
+  np->policy = p->policy == SCHED_EDF ? sched_default : p->policy;
+  np->cpu = leastloaded();
+  if(sched_class[np->policy]->place)
+    sched_class[np->policy]->place(np, 1);
+  account(np);
   np->state = RUNNABLE;
+  runq_add(np);
   release(&np->lock);
   
   return pid;
 }
 
-// Pass p's abandoned children to init.
+// Pass p's abandoned children to init, splicing
+// them onto the front of init's child list.
 // Caller must hold wait_lock.
 void
 reparent(struct proc *p)
 {
-  struct proc *pp;
+  struct proc *pp, *last = 0;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  if(p->child == 0)
+    return;
+  for(pp = p->child; pp; pp = pp->sibnext){
+    pp->parent = initproc;
+    last = pp;
   }
+  last->sibnext = initproc->child;
+  if(initproc->child)
+    initproc->child->sibpprev = &last->sibnext;
+  initproc->child = p->child;
+  p->child->sibpprev = &initproc->child;
+  p->child = 0;
+  wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
-// until its parent calls wait().
+// until its parent calls wait(). Called by a thread,
+// exit ends just that thread, which stays a zombie
+// until another thread of its process calls join().
+// Called by a process, exit first ends its threads.
 void
 exit(int status)
 {
   struct proc *p = myproc();
+  struct proc *t, *next;
 
   if(p == initproc)
     panic("init exiting");
 
+  acquire(&wait_lock);
+  if(p->leader != p){
+    reparent(p);
+    // the leader or a thread might be sleeping in
+    // exit() or join().
+    wakeup(&p->leader->threads);
+    goto zombie;
+  }
+  // the threads use p's files and memory; kill them and
+  // wait until they are gone.
+  while(p->threads){
+    for(t = p->threads; t; t = next){
+      next = t->sibnext;
+      acquire(&t->lock);
+      if(t->state == ZOMBIE)
+        freeproc(t);
+      else
+        killproc(t);
+      release(&t->lock);
+    }
+    if(p->threads)
+      sleep(&p->threads, &wait_lock);
+  }
+  release(&wait_lock);
+
+  // write shared mappings back to their files, if they
+  // can be; there is no one left to tell if not.
+  if(vmaclear(p, 1) < 0)
+    vmaclear(p, 0);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -379,8 +1184,13 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->exe){
+    iexec(p->exe, -1);
+    iput(p->exe);
+  }
   end_op();
   p->cwd = 0;
+  p->exe = 0;
 
   acquire(&wait_lock);
 
@@ -389,10 +1199,15 @@ exit(int status)
 
   // Parent might be sleeping in wait().
   wakeup(p->parent);
-  
+
+zombie:
   acquire(&p->lock);
 
   p->xstate = status;
+  p->ttime = (int)ticks;
+  account(p);
+  if(sched_class[p->policy]->leave)
+    sched_class[p->policy]->leave(p);
   p->state = ZOMBIE;
 
   release(&wait_lock);
@@ -411,33 +1226,33 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the status is copied out under wait_lock.
+  prefault(addr, sizeof(int));
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through the child list looking for exited children.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      if(np->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&np->lock);
-
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(np);
+    for(np = p->child; np; np = np->sibnext){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&np->lock);
+
+      havekids = 1;
+      if(np->state == ZOMBIE){
+        // Found one.
+        pid = np->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
+                                sizeof(np->xstate)) < 0) {
           release(&np->lock);
           release(&wait_lock);
-          return pid;
+          return -1;
         }
+        freeproc(np);
         release(&np->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&np->lock);
     }
 
     // No point waiting if we don't have any children.
@@ -451,203 +1266,240 @@ wait(uint64 addr)
   }
 }
 
-
-// Per-CPU process scheduler.
-// Each CPU calls scheduler() after setting itself up.
-// Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
-//  - swtch to start running that process.
-//  - eventually that process transfers control
-//    via swtch back to the scheduler.
-#ifdef DEFAULT
-void
-scheduler(void)
+// Create a thread of the current process, which starts
+// in fn(arg) on the given user stack, sharing the
+// process's memory, open files and current directory.
+// flags is reserved and must be 0. The thread should
+// end by calling exit(); fn must not return.
+// Return the new thread's id, a pid, for join().
+int
+clone(uint64 fn, uint64 stack, int flags, uint64 arg)
 {
-  struct proc *p;
-  struct cpu *c = mycpu();
-  
-  c->proc = 0;
-  for(;;){
-    // Avoid deadlock by ensuring that devices can interrupt.
-    intr_on();
+  int tid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *leader = p->leader;
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+  if(flags != 0 || stack % 16 != 0)
+    return -1;
+
+  // the first thread: threads can't have copy-on-write
+  // pages shared with another process, whose faults
+  // only flush one hart's TLB.
+  if(leader->threads == 0){
+    acquire(&leader->tlock);
+    if(uvmunshare(leader->pagetable, 0, leader->sz) < 0 ||
+       vmaunshare(leader) < 0){
+      release(&leader->tlock);
+      return -1;
     }
+    release(&leader->tlock);
   }
-}
-#endif
 
+  if((np = allocproc(leader)) == 0)
+    return -1;
 
-#ifdef FCFS
-void
-scheduler(void)
-{
-  struct proc *p;
-  struct cpu *c = mycpu();
-  struct proc *fc_p = 0;
-  
-  c->proc = 0;
-  for(;;){
-    intr_on();
-
-    fc_p = 0;
-    
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack;
+  np->trapframe->a0 = arg;
+  np->trapframe->ra = 0;
 
-      if(p->state == RUNNABLE) {
-        if(fc_p == 0){
-          fc_p = p;
-        }
-        else if(p->runnabletime < fc_p->runnabletime){
-          fc_p = p;
-        }
-      }
-      release(&p->lock);
-    }
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->mask = p->mask;
+  tid = np->pid;
 
-    if(fc_p != 0){
+  release(&np->lock);
 
-      acquire(&fc_p->lock);
+  acquire(&wait_lock);
+  np->sibnext = leader->threads;
+  if(leader->threads)
+    leader->threads->sibpprev = &np->sibnext;
+  leader->threads = np;
+  np->sibpprev = &leader->threads;
+  release(&wait_lock);
 
-      if(fc_p->state == RUNNABLE){
+  acquire(&np->lock);
+  np->priority = p->priority;
+  np->policy = p->policy == SCHED_EDF ? sched_default : p->policy;
+  np->cpu = leastloaded();
+  if(sched_class[np->policy]->place)
+    sched_class[np->policy]->place(np, 1);
+  account(np);
+  np->state = RUNNABLE;
+  runq_add(np);
+  release(&np->lock);
 
-        fc_p->state = RUNNING;
-        c->proc = fc_p;
-        swtch(&c->context, &fc_p->context);
-        c->proc = 0;
-      }
-      
-      release(&fc_p->lock);
-    }
-  }
+  return tid;
 }
-#endif
 
-
-#ifdef SRT
-void
-scheduler(void)
+// Wait for thread tid of the current process to exit,
+// copy its exit status to addr, and free it.
+// Return tid, or -1 if there is no such thread.
+int
+join(int tid, uint64 addr)
 {
-  struct proc *p;
-  struct cpu *c = mycpu();
-  struct proc *srt_p;
-  
-  c->proc = 0;
-  for(;;){
-    intr_on();
+  struct proc *t;
+  struct proc *p = myproc();
+  struct proc *leader = p->leader;
 
-    srt_p = 0;
+  prefault(addr, sizeof(int));
+  acquire(&wait_lock);
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
+  for(;;){
+    for(t = leader->threads; t; t = t->sibnext)
+      if(t->pid == tid)
+        break;
+    if(t == 0 || t == p || p->killed){
+      release(&wait_lock);
+      return -1;
+    }
 
-      if(p->state == RUNNABLE) {
-        if(!srt_p){
-          srt_p = p;
-        }
-        else if(p->average_bursttime < srt_p->average_bursttime){
-          srt_p = p;
-        }
+    acquire(&t->lock);
+    if(t->state == ZOMBIE){
+      if(addr != 0 && copyout(p->pagetable, addr, (char *)&t->xstate,
+                              sizeof(t->xstate)) < 0) {
+        release(&t->lock);
+        release(&wait_lock);
+        return -1;
       }
-      release(&p->lock);
+      freeproc(t);
+      release(&t->lock);
+      release(&wait_lock);
+      return tid;
     }
+    release(&t->lock);
 
-    if(srt_p != 0){
-      p = srt_p;
+    // Wait for a thread to exit.
+    sleep(&leader->threads, &wait_lock);
+  }
+}
 
-      acquire(&p->lock);
 
-      if(p->state == RUNNABLE){
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
+// Give c's cached kernel stacks and slab objects back.
+// Called on c with interrupts off.
+static void
+trim(struct cpu *c)
+{
+  c->kshort = kshortage();
+  while(c->nkstack > 0)
+    kstackunmap(c->kstacks[--c->nkstack]);
+  slabidle();
+}
 
-        c->proc = 0;
-      }
-      release(&p->lock);
-    }
-  }
+// kalloc() has run out of memory: give back this cpu's
+// caches, and wake idle harts to give back theirs (see
+// idle()). Harts running processes do so when they next
+// go idle.
+void
+reclaim(void)
+{
+  struct cpu *c;
+
+  push_off();
+  trim(mycpu());
+  pop_off();
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    if(c->started && c->idle)
+      ipi(c - cpus);
 }
-#endif
 
+// Called by scheduler() when c has nothing to run.
+// Halt the hart until an interrupt: a device, the timer,
+// or an IPI from a hart that queued work for us (see
+// runq_kick()). Hart 0 keeps its timer set for the next
+// kernel timer; the others turn theirs off, so idle
+// harts take no ticks at all. An idle hart keeps its
+// cached kernel stacks and slab objects for the next
+// process, unless memory has run short since it last
+// gave them back.
+static void
+idle(struct cpu *c)
+{
+  intr_off();
+  c->idle = 1;
+  // pairs with the lock release in runq_add(): either
+  // we see the new process or the enqueuer sees idle.
+  __sync_synchronize();
+  if(c->runq.len == 0){
+    if(c->kshort != kshortage())
+      trim(c);
+    if(c == &cpus[0])
+      setdeadline((uint64)timer_next() * TICKCYCLES);
+    else
+      setdeadline(~0UL);  // never
+    wfi();
+    // whatever woke us, such as a device, may wake a
+    // process that reads ticks; it mustn't be stale.
+    tickcatchup();
+  }
+  c->idle = 0;
+}
 
-#ifdef CFSD
+// Per-CPU process scheduler.
+// Each CPU calls scheduler() after setting itself up.
+// Scheduler never returns.  It loops, doing:
+//  - choose a process to run.
+//  - swtch to start running that process.
+//  - eventually that process transfers control
+//    via swtch back to the scheduler.
+//
+// Each CPU only looks at its own run queue, which is kept
+// in policy order, so picking a process costs O(1) no
+// matter how many processes exist.
 void
 scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
-  struct proc *cfsd_p;
-  int p_ratio;
-  int acc_ratio;
   
   c->proc = 0;
+  c->started = 1;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    cfsd_p = 0;
-    p_ratio = 0;
-    acc_ratio = 0;
-
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-
-      if(p->state == RUNNABLE) {
-
-        p_ratio = (p->rutime * p->priority)/(p->rutime + p->stime);
-        // printf("p_ratio: %d\n", p_ratio);
-        // printf("priority: %d\n", p->priority);
-        // printf("rutime: %d\n", p->rutime);
-        // printf("stime: %d\n", p->stime);
-
-        if(!cfsd_p){
-          cfsd_p = p;
-          acc_ratio = p_ratio;
-        }
-        else if(p_ratio < acc_ratio){
-          cfsd_p = p;
-          acc_ratio = p_ratio;
-        }
-      }
-      release(&p->lock);
+    if((p = runq_pop(c)) == 0 && (p = runq_steal(c)) == 0){
+      idle(c);
+      continue;
     }
 
-    if(cfsd_p != 0){
-      p = cfsd_p;
-
-      acquire(&p->lock);
-
-      if(p->state == RUNNABLE){
-        p->state = RUNNING;
-        c->proc = p;
-        int run = ticks;
-        swtch(&c->context, &p->context);
-        p->rutime += ticks-run;
-        c->proc = 0;
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      account(p);
+      p->state = RUNNING;
+      if(p->cpu != c){
+        // stolen from another cpu's queue.
+        p->cpu = c;
+        p->migrations++;
       }
-      release(&p->lock);
+      c->proc = p;
+      p->dispatched = r_time();
+      if(sched_class[p->policy]->start)
+        sched_class[p->policy]->start(p);
+      // p's kernel stack may be newer than what this
+      // hart's TLB knows of the kernel page table.
+      if(c->kstackgen != kstackgen){
+        c->kstackgen = kstackgen;
+        sfence_vma();
+      }
+      // idle() may have turned the timer off;
+      // p needs the tick for preemption.
+      if(c->deadline > nexttick())
+        setdeadline(nexttick());
+      c->resched = 0;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
     }
+    release(&p->lock);
   }
 }
-#endif
-
-
 
 // Switch to scheduler.  Must hold only p->lock
 // and have changed proc->state. Saves and restores
@@ -688,12 +1540,14 @@ yield(void)
 
   acquire(&p->lock);
 
-  // update approximated burst time when proccess is yield
-  p->average_bursttime = ALPHA * p->current_bursttime + ((100 - ALPHA)* p->average_bursttime)/100;
-  p->current_bursttime = 0;
+  // p's burst goes on until it blocks.
+  p->burst += account(p);
 
   p->state = RUNNABLE;
   p->runnabletime = time;
+  if(sched_class[p->policy]->stop)
+    sched_class[p->policy]->stop(p);
+  runq_add(p);
 
   sched();
   release(&p->lock);
@@ -720,58 +1574,208 @@ forkret(void)
   usertrapret();
 }
 
-// Atomically release lock and sleep on chan.
-// Reacquires lock when awakened.
-void
-sleep(void *chan, struct spinlock *lk)
+// Return the sleep queue for chan. Channels are
+// addresses, so use a multiplicative hash to spread
+// nearby ones over the table.
+static struct sleepq*
+sleepq_of(void *chan)
+{
+  return &sleepq[((uint64)chan * 0x9E3779B97F4A7C15L) >> (64 - SLEEPQBITS)];
+}
+
+// Add p to the head of sq. Caller must hold sq->lock.
+static void
+sleepq_insert(struct sleepq *sq, struct proc *p)
+{
+  p->sqnext = sq->head;
+  if(sq->head)
+    sq->head->sqpprev = &p->sqnext;
+  sq->head = p;
+  p->sqpprev = &sq->head;
+}
+
+// Take p off its sleep queue. Caller must hold that queue's lock.
+static void
+sleepq_remove(struct proc *p)
+{
+  *p->sqpprev = p->sqnext;
+  if(p->sqnext)
+    p->sqnext->sqpprev = p->sqpprev;
+  p->sqnext = 0;
+  p->sqpprev = 0;
+}
+
+// Sleep on chan, which hashes to sq, releasing lk if
+// it isn't 0. Caller must hold sq->lock, which is
+// released on return.
+static void
+sleepq_wait(struct sleepq *sq, void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
-  
-  // Must acquire p->lock in order to
-  // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
 
   acquire(&p->lock);  //DOC: sleeplock1
 
-  // update approximated burst time when proccess is blocked
-  p->average_bursttime = ALPHA * p->current_bursttime + ((100 - ALPHA)* p->average_bursttime)/100;
-  p->current_bursttime = 0;
+  // p's burst ends here; fold it into the prediction.
+  p->burst += account(p);
+  p->burst_pred = (ALPHA_Q16 * p->burst + ((1 << 16) - ALPHA_Q16) * p->burst_pred) >> 16;
+  p->burst = 0;
+  if(sched_class[p->policy]->stop)
+    sched_class[p->policy]->stop(p);
 
-  release(lk);
+  if(lk)
+    release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  sleepq_insert(sq, p);
+  release(&sq->lock);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  // wakeup() takes p off the queue, but kill() doesn't.
+  acquire(&sq->lock);
+  if(p->sqpprev)
+    sleepq_remove(p);
+  release(&sq->lock);
+}
+
+// Atomically release lock and sleep on chan.
+// Reacquires lock when awakened.
+void
+sleep(void *chan, struct spinlock *lk)
+{
+  struct sleepq *sq = sleepq_of(chan);
+
+  // Must acquire sq->lock in order to join chan's
+  // sleep queue, and p->lock in order to
+  // change p->state and then call sched.
+  // Once we hold sq->lock, we can be
+  // guaranteed that we won't miss any wakeup
+  // (wakeup locks sq->lock),
+  // so it's okay to release lk.
+  acquire(&sq->lock);
+  sleepq_wait(sq, chan, lk);
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
+// Wake up to n processes sleeping on chan, or all
+// of them if n is negative. Return how many woke.
+static int
+sleepq_wake(void *chan, int n)
+{
+  struct sleepq *sq = sleepq_of(chan);
+  struct proc *p, *next;
+  int woken = 0;
+
+  acquire(&sq->lock);
+  for(p = sq->head; p && woken != n; p = next){
+    next = p->sqnext;
+    if(p->chan != chan)
+      continue;
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan) {
+      sleepq_remove(p);
+      account(p);
+      p->state = RUNNABLE;
+      p->runnabletime = (int)ticks;
+      if(sched_class[p->policy]->place)
+        sched_class[p->policy]->place(p, 0);
+      runq_add(p);
+      woken++;
+    }
+    release(&p->lock);
+  }
+  release(&sq->lock);
+  return woken;
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  sleepq_wake(chan, -1);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-        p->runnabletime = (int)ticks;
-      }
-      release(&p->lock);
-    }
+// Return the kernel address of the user int at addr,
+// for use as a futex wait channel. Keying by physical
+// rather than virtual address lets processes that map
+// the same page at different addresses share futexes.
+static int*
+futex_chan(uint64 addr)
+{
+  uint64 pa;
+
+  pagetable_t pagetable = myproc()->pagetable;
+
+  if(addr % sizeof(int) != 0)
+    return 0;
+  if((pa = walkaddr(pagetable, addr)) == 0 &&
+     (pagefault(pagetable, addr, PTE_R) < 0 || (pa = walkaddr(pagetable, addr)) == 0))
+    return 0;
+  return (int*)(pa + addr % PGSIZE);
+}
+
+// Sleep until woken by futex_wake() on addr, provided
+// the int there still holds val. Return -1 at once if
+// it doesn't, or if addr is bad or p is killed.
+int
+futex_wait(uint64 addr, int val)
+{
+  struct sleepq *sq;
+  int *chan;
+
+  if((chan = futex_chan(addr)) == 0)
+    return -1;
+  sq = sleepq_of(chan);
+
+  // futex_wake() takes sq->lock, so checking val under it
+  // leaves no gap for a wakeup to be lost in.
+  acquire(&sq->lock);
+  if(__atomic_load_n(chan, __ATOMIC_SEQ_CST) != val){
+    release(&sq->lock);
+    return -1;
+  }
+  sleepq_wait(sq, chan, 0);
+  return myproc()->killed ? -1 : 0;
+}
+
+// Wake up to n processes waiting on the futex at addr.
+// Return how many woke, or -1 if addr is bad.
+int
+futex_wake(uint64 addr, int n)
+{
+  int *chan;
+
+  if(n < 0 || (chan = futex_chan(addr)) == 0)
+    return -1;
+  return sleepq_wake(chan, n);
+}
+
+// Mark p killed and get it moving, so that it notices.
+// Caller must hold p->lock.
+static void
+killproc(struct proc *p)
+{
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep(), which will
+    // take it off its sleep queue.
+    account(p);
+    p->state = RUNNABLE;
+    if(sched_class[p->policy]->place)
+      sched_class[p->policy]->place(p, 0);
+    runq_add(p);
+  } else if(p->state == RUNNING){
+    // make it trap, and so notice p->killed, now.
+    ipi(p->cpu - cpus);
   }
 }
 
@@ -783,20 +1787,11 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
-    release(&p->lock);
-  }
-  return -1;
+  if((p = findproc(pid)) == 0)
+    return -1;
+  killproc(p);
+  release(&p->lock);
+  return 0;
 }
 
 // Copy to either a user address, or kernel address,
@@ -842,46 +1837,25 @@ procdump(void)
   [RUNNING]   "run   ",
   [ZOMBIE]    "zombie"
   };
+  struct procpage *pg;
   struct proc *p;
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->state == UNUSED)
-      continue;
-    if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
-      state = states[p->state];
-    else
-      state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
-    printf("\n");
-  }
-}
-
-// Update the time fields for each process
-void
-update_time()
-{
-  struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-
-      if(p->state == SLEEPING){
-        p->stime ++;
-      }
-      else if(p->state == RUNNABLE){
-        p->retime ++;
-      }
-      else if(p->state == RUNNING){
-        p->rutime ++;
-        p->current_bursttime ++;
-      }
-
-      release(&p->lock);
+  procwalk();
+  for(pg = allpages; pg; pg = pg->next){
+    for(p = pg->procs; p < &pg->procs[NPROCPAGE]; p++){
+      if(p->state == UNUSED)
+        continue;
+      if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
+        state = states[p->state];
+      else
+        state = "???";
+      printf("%d %s %s %s", p->pid, state, sched_class[p->policy]->name, p->name);
+      printf("\n");
     }
   }
+  procunwalk();
 }
 
 int
@@ -891,67 +1865,68 @@ trace(int mask, int pid){
 
   struct proc *p;
 
-  for(p = proc; p< &proc[NPROC]; p++){
-    if(p->pid == pid){
-      p->mask = mask;
-      return 0;
-    }
-  }
-
-  return -1;  
+  if((p = findproc(pid)) == 0)
+    return -1;
+  p->mask = mask;
+  release(&p->lock);
+  return 0;
 }
 
 int 
 wait_stat(uint64 status, uint64 performance)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, i;
   struct proc *p = myproc();
-  int time;
+  struct perf perf;
 
+  prefault(status, sizeof(int));
+  prefault(performance, sizeof(struct perf));
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through the child list looking for exited children.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      if(np->parent == p){
-
-        acquire(&tickslock);
-        time = ticks;
-        release(&tickslock);
-
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&np->lock);
-
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-
-          np->ttime = time;
-
-          if(performance != 0 && copyout(p->pagetable, (uint64)performance, (char *)&np->ctime,
-                                  sizeof(*(struct perf*)performance)) < 0) {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
-
-          if(status != 0 && copyout(p->pagetable, (uint64)status, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
-
-          freeproc(np);
+    for(np = p->child; np; np = np->sibnext){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&np->lock);
+
+      havekids = 1;
+      if(np->state == ZOMBIE){
+        // Found one.
+        pid = np->pid;
+
+        perf.ctime = np->ctime;
+        perf.ttime = np->ttime;
+        perf.stime = np->stime / TICKCYCLES;
+        perf.retime = np->retime / TICKCYCLES;
+        perf.rutime = np->rutime / TICKCYCLES;
+        perf.average_bursttime = np->burst_pred * 100 / TICKCYCLES;
+        perf.migrations = np->migrations;
+        for(i = 0; i < NMLFQ; i++)
+          perf.leveltime[i] = np->leveltime[i] / TICKCYCLES;
+        perf.misses = np->misses;
+
+        if(performance != 0 && copyout(p->pagetable, (uint64)performance, (char *)&perf,
+                                sizeof(perf)) < 0) {
           release(&np->lock);
           release(&wait_lock);
-          return pid;
+          return -1;
         }
+
+        if(status != 0 && copyout(p->pagetable, (uint64)status, (char *)&np->xstate,
+                                sizeof(np->xstate)) < 0) {
+          release(&np->lock);
+          release(&wait_lock);
+          return -1;
+        }
+
+        freeproc(np);
         release(&np->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&np->lock);
     }
 
     // No point waiting if we don't have any children.
@@ -974,6 +1949,10 @@ set_priority(int priority)
 
   acquire(&p->lock);
 
+  // charge the time run so far at the old weight.
+  if(sched_class[p->policy]->stop)
+    sched_class[p->policy]->stop(p);
+
   switch (priority)
   {
     case 1:
@@ -1003,4 +1982,148 @@ set_priority(int priority)
 
   release(&p->lock);
   return result;
-}
\ No newline at end of file
+}
+
+// Move p to another scheduling policy, taking it off
+// its run queue and back on if it is queued.
+// Caller must hold p->lock.
+static void
+setpolicy(struct proc *p, int policy)
+{
+  struct sched_class *old = sched_class[p->policy];
+  struct sched_class *new = sched_class[policy];
+  struct runq *rq = &p->cpu->runq;
+  int queued;
+
+  if(p->state == RUNNING && old->stop)
+    old->stop(p);
+  if(old->leave)
+    old->leave(p);
+  acquire(&rq->lock);
+  // a RUNNABLE p may be off the queue, on its way
+  // to running, in scheduler().
+  queued = p->queued;
+  if(queued)
+    old->dequeue(rq, p);
+  p->policy = policy;
+  if(new->place)
+    new->place(p, 1);
+  if(queued)
+    new->enqueue(rq, p);
+  release(&rq->lock);
+  if(p->state == RUNNING && new->start)
+    new->start(p);
+}
+
+// Set the scheduling policy of process pid, or of the
+// calling process if pid is 0. If pid is -1, set the
+// policy of every process. Children inherit the policy.
+int
+sched_setpolicy(int pid, int policy)
+{
+  struct procpage *pg;
+  struct proc *p;
+
+  // EDF needs parameters; see sched_setdeadline().
+  if(policy < 0 || policy >= NSCHED || policy == SCHED_EDF || pid < -1)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  if(pid > 0){
+    if((p = findproc(pid)) == 0)
+      return -1;
+    if(p->cpu && p->policy != policy)
+      setpolicy(p, policy);
+    release(&p->lock);
+    return 0;
+  }
+
+  sched_default = policy;
+  procwalk();
+  for(pg = allpages; pg; pg = pg->next){
+    for(p = pg->procs; p < &pg->procs[NPROCPAGE]; p++){
+      acquire(&p->lock);
+      if(p->state != UNUSED && p->cpu && p->policy != policy)
+        setpolicy(p, policy);
+      release(&p->lock);
+    }
+  }
+  procunwalk();
+  return 0;
+}
+
+// Called on each clock tick: should the running process
+// give up the cpu, by its policy?
+int
+sched_tick(void)
+{
+  struct proc *p = myproc();
+  struct sched_class *sc;
+  int r = 0;
+
+  if(p == 0)
+    return 0;
+  // sched_setpolicy() may be changing p's policy.
+  acquire(&p->lock);
+  sc = sched_class[p->policy];
+  if(p->state == RUNNING && sc->tick)
+    r = sc->tick(p);
+  release(&p->lock);
+  return r;
+}
+
+// Make the calling process an EDF process needing runtime
+// ticks of cpu every period ticks, done within deadline
+// ticks of the start of each period. Fails if the EDF
+// processes would then need more than the machine has.
+int
+sched_setdeadline(int runtime, int deadline, int period)
+{
+  struct proc *p = myproc();
+
+  if(runtime <= 0 || runtime > deadline || deadline > period)
+    return -1;
+
+  acquire(&p->lock);
+  if(edf_admit(p, ((uint64)runtime << 16) / period) < 0){
+    release(&p->lock);
+    return -1;
+  }
+  p->dl_runtime = (uint64)runtime * TICKCYCLES;
+  p->dl_deadline = (uint64)deadline * TICKCYCLES;
+  p->dl_period = (uint64)period * TICKCYCLES;
+  if(p->policy == SCHED_EDF){
+    // start over with the new parameters.
+    sched_class[SCHED_EDF]->stop(p);
+    sched_class[SCHED_EDF]->place(p, 1);
+  } else {
+    setpolicy(p, SCHED_EDF);
+  }
+  release(&p->lock);
+  return 0;
+}
+
+// The running EDF process has used up its budget (see
+// edf_tick()): wait until its deadline, when wakeup()
+// gives it a new budget and deadline. If the deadline
+// has already passed, start the next job at once, queued
+// behind the jobs due before it.
+void
+sched_throttle(void)
+{
+  struct proc *p = myproc();
+  uint64 deadline;
+
+  acquire(&p->lock);
+  p->throttled = 0;
+  deadline = p->deadline;
+  if(deadline <= r_time()){
+    if(p->policy == SCHED_EDF)
+      sched_class[SCHED_EDF]->place(p, 0);
+    release(&p->lock);
+    yield();
+    return;
+  }
+  release(&p->lock);
+  timer_sleep((deadline + TICKCYCLES - 1) / TICKCYCLES - r_time() / TICKCYCLES);
+}
@@ -18,12 +18,71 @@ struct context {
   uint64 s11;
 };
 
+// A FIFO of processes, linked through p->rqnext.
+struct proclist {
+  struct proc *head;
+  struct proc *tail;
+};
+
+// SRT heap entries per page.
+#define HEAPPAGE (PGSIZE / sizeof(struct proc*))
+
+// Per-CPU queue of RUNNABLE processes. Each scheduling
+// policy keeps its own processes in the order it wants
+// them run, in whichever structure below suits it.
+struct runq {
+  struct spinlock lock;
+  int len;                    // Number of queued processes.
+  int next;                   // Policy to pick from first.
+  struct proclist list[NSCHED]; // List policies: in the order to run.
+  struct proc **heap[(NPROC + HEAPPAGE - 1) / HEAPPAGE]; // SRT: min-heap by
+                              // predicted time left, in pages of entries.
+  int nheap;
+  int heapcap;                // SRT: entries the heap pages hold.
+  struct rbroot tree;         // CFSD: processes ordered by vruntime.
+  uint64 min_vruntime;        // CFSD: never decreases.
+  struct proclist mlfq[NMLFQ]; // MLFQ: one list per level.
+  uint mlfqmap;               // MLFQ: bit i set if mlfq[i] is not empty.
+  uint mlfqepoch;             // MLFQ: boost epoch of the levels.
+  struct rbroot dltree;       // EDF: processes ordered by deadline.
+};
+
+// A scheduling policy (see sched.c). A realtime policy's
+// processes run ahead of all others'. enqueue, dequeue
+// and pick_next are called with the run queue's lock
+// held, and migrate with both run queues' locks held;
+// the rest with p->lock held. Any hook but the first
+// three may be 0.
+struct sched_class {
+  char *name;
+  int realtime;
+  void (*enqueue)(struct runq*, struct proc*);
+  void (*dequeue)(struct runq*, struct proc*);
+  struct proc* (*pick_next)(struct runq*);   // Take the next process off.
+  void (*place)(struct proc*, int new);      // Before queueing a new or woken process.
+  void (*start)(struct proc*);               // Dispatched.
+  void (*stop)(struct proc*);                // Leaving the cpu, or changing priority.
+  void (*migrate)(struct proc*, struct runq *from, struct runq *to);
+  void (*leave)(struct proc*);               // Leaving the policy, or exiting.
+  int (*tick)(struct proc*);                 // Clock tick: preempt the running process?
+  int (*preempt)(struct proc*, struct proc *curr); // Should woken p preempt curr?
+};
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  struct runq runq;           // Processes waiting to run on this cpu.
+  int started;                // Has this cpu entered scheduler()?
+  int idle;                   // Halted in wfi with nothing to run?
+  uint64 deadline;            // Cycle count of the next timer interrupt.
+  int resched;                // Another hart wants this one to yield.
+  uint64 kstacks[NKSTACKCACHE]; // Free kernel stacks.
+  int nkstack;
+  uint kshort;                // kshortage() as of the last trim().
+  uint kstackgen;             // kstackgen as of the last TLB flush.
 };
 
 extern struct cpu cpus[NCPU];
@@ -88,6 +147,27 @@ enum priority  {TEST_HIGH = 1,
                 LOW = 7,
                 TEST_LOW = 25};
 
+// A loadable segment of a program, whose pages are read
+// from the executable when first touched.
+struct execseg {
+  uint64 va;                   // Start, page-aligned
+  uint64 filesz;               // Bytes from the file; the rest is zero
+  uint off;                    // Offset of the data in the file
+  int text;                    // Read-only; pages shared through exe->text
+};
+
+// A region of memory mapped by mmap(). Its pages are
+// filled in from the file, or zeroed, when first touched.
+struct vma {
+  uint64 start;                // First byte, page-aligned
+  uint64 end;                  // Last byte + 1, page-aligned
+  int prot;                    // PROT_ bits
+  int flags;                   // MAP_ bits
+  struct file *f;              // Mapped file, or 0 if anonymous
+  uint off;                    // Offset in f of start
+  struct vma *next;            // Next region down in memory
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -99,36 +179,84 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
-  // proc_tree_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *child;          // First child
+  struct proc *sibnext;        // Next child of parent, or next thread
+  struct proc **sibpprev;      // Link pointing at p; 0 if on no list
+  struct proc *threads;        // Leader: its other threads
+
+  // pid_lock must be held when using these:
+  struct proc *pidnext;        // Next process in the pid hash chain
+  struct proc **pidpprev;      // Link pointing at p; 0 if not hashed
+
+  struct proc *nextfree;       // Next on its page's free stack, if UNUSED
+
+  // a thread shares its leader's memory, open files and
+  // cwd; only the leader's sz, vmas, ofile[], cwd and exe
+  // are used.
+  struct proc *leader;         // Thread group leader; p itself if not a thread
+  uint64 trapva;               // Where p->trapframe is mapped in the page table
+  struct spinlock tlock;       // Leader: protects sz, vmas, ofile[] and tslots
+  uint tslots;                 // Leader: trapframe slots in use, a bit each
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
+  struct vma *vmas;            // mmap() regions, highest first
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Executable, to load pages from
+  struct execseg seg[NSEG];    // Its loadable segments
+  int nseg;
   char name[16];               // Process name (debugging)
   int mask;
   int ctime;                  // Process creation time
   int ttime;                  // Process termination time
-  int stime;                  // The total time the process spent in the SLEEPING mode
-  int retime;                 // The total time the process spent in the RUNNABLE mode
-  int rutime;                 // The total time the process spent in the RUNNING mode
-  int average_bursttime;      // Approximate estimated burst time
+  uint64 stime;               // Cycles spent in the SLEEPING mode
+  uint64 retime;              // Cycles spent in the RUNNABLE mode
+  uint64 rutime;              // Cycles spent in the RUNNING mode
+  uint64 tstamp;              // Cycle count at the last change of state
+  uint64 burst;               // Cycles run since p last blocked
+  uint64 burst_pred;          // Predicted length of p's bursts, in cycles
 
-  int current_bursttime;      // Last burst time on cpu 
   enum priority priority;     // The process priority
   int runnabletime;           // The time a proccess become runnable
-};
 
-struct perf {
-  int ctime;                  // Process creation time
-  int ttime;                  // Process termination time
-  int stime;                  // The total time the process spent in the SLEEPING mode
-  int retime;                 // The total time the process spent in the RUNNABLE mode
-  int rutime;                 // The total time the process spent in the RUNNING mode
-  int average_bursttime;      // Average of bursttimes in 100ths (so average * 100)
+  // chan's sleep queue lock must be held when using these:
+  struct proc *sqnext;        // Next process in the sleep queue
+  struct proc **sqpprev;      // Link pointing at p; 0 if not queued
+
+  // the run queue lock must be held when using these:
+  int queued;                 // On p->cpu's run queue?
+  struct proc *rqnext;        // Next process in the run queue
+  struct rbnode rbnode;       // CFSD run queue tree node
+  int heapidx;                // SRT index in the run queue heap
+
+  int policy;                 // Scheduling policy, SCHED_*
+  uint64 dispatched;          // Cycle count when last given a cpu
+
+  uint64 vruntime;            // CFSD weighted run time, in cycles
+  uint64 exec_start;          // CFSD, MLFQ cycle count when last charged
+
+  int level;                  // MLFQ level, 0 highest
+  uint epoch;                 // MLFQ boost epoch of level
+  uint64 leveltime[NMLFQ];    // MLFQ cycles run at each level
+  uint64 levelused;           // MLFQ cycles of the slice used at level
+
+  uint64 dl_runtime;          // EDF budget per period, in cycles
+  uint64 dl_deadline;         // EDF deadline, in cycles from release
+  uint64 dl_period;           // EDF period, in cycles
+  uint dl_bw;                 // EDF dl_runtime/dl_period, 16.16 fixed point
+  uint64 deadline;            // EDF absolute deadline of the current job
+  uint64 dl_left;             // EDF budget left for the current job
+  int throttled;              // EDF budget used up; wait for replenishment
+  int missed;                 // EDF current job has missed its deadline
+  int misses;                 // EDF deadline misses
+
+  struct cpu *cpu;            // Cpu whose run queue p goes on
+  int migrations;             // Times stolen by another cpu
 };
@@ -0,0 +1,261 @@
+// Red-black trees.
+//
+// The scheduler uses these to keep runnable processes
+// sorted by a key, with O(log n) insert, erase and
+// lookup of the smallest element. The caller supplies
+// the ordering and does its own locking.
+
+#include "types.h"
+#include "riscv.h"
+#include "rbtree.h"
+#include "defs.h"
+
+static void
+rotate_left(struct rbroot *root, struct rbnode *x)
+{
+  struct rbnode *y = x->right;
+
+  x->right = y->left;
+  if(y->left)
+    y->left->parent = x;
+  y->parent = x->parent;
+  if(x->parent == 0)
+    root->node = y;
+  else if(x == x->parent->left)
+    x->parent->left = y;
+  else
+    x->parent->right = y;
+  y->left = x;
+  x->parent = y;
+}
+
+static void
+rotate_right(struct rbroot *root, struct rbnode *x)
+{
+  struct rbnode *y = x->left;
+
+  x->left = y->right;
+  if(y->right)
+    y->right->parent = x;
+  y->parent = x->parent;
+  if(x->parent == 0)
+    root->node = y;
+  else if(x == x->parent->right)
+    x->parent->right = y;
+  else
+    x->parent->left = y;
+  y->right = x;
+  x->parent = y;
+}
+
+static int
+isred(struct rbnode *n)
+{
+  return n != 0 && n->red;
+}
+
+// Insert n, which is not in any tree.
+// less(a, b) returns whether a sorts before b;
+// n goes after any nodes that compare equal to it.
+void
+rb_insert(struct rbroot *root, struct rbnode *n,
+          int (*less)(struct rbnode*, struct rbnode*))
+{
+  struct rbnode **link = &root->node;
+  struct rbnode *p = 0, *g, *u;
+
+  while(*link){
+    p = *link;
+    if(less(n, p))
+      link = &p->left;
+    else
+      link = &p->right;
+  }
+  n->parent = p;
+  n->left = n->right = 0;
+  n->red = 1;
+  *link = n;
+
+  // restore the red-black properties.
+  while((p = n->parent) != 0 && p->red){
+    g = p->parent;  // p is red, so not the root.
+    if(p == g->left){
+      u = g->right;
+      if(isred(u)){
+        p->red = u->red = 0;
+        g->red = 1;
+        n = g;
+        continue;
+      }
+      if(n == p->right){
+        rotate_left(root, p);
+        n = p;
+        p = n->parent;
+      }
+      p->red = 0;
+      g->red = 1;
+      rotate_right(root, g);
+    } else {
+      u = g->left;
+      if(isred(u)){
+        p->red = u->red = 0;
+        g->red = 1;
+        n = g;
+        continue;
+      }
+      if(n == p->left){
+        rotate_right(root, p);
+        n = p;
+        p = n->parent;
+      }
+      p->red = 0;
+      g->red = 1;
+      rotate_left(root, g);
+    }
+  }
+  root->node->red = 0;
+}
+
+// Put v where u is in the tree.
+static void
+transplant(struct rbroot *root, struct rbnode *u, struct rbnode *v)
+{
+  if(u->parent == 0)
+    root->node = v;
+  else if(u == u->parent->left)
+    u->parent->left = v;
+  else
+    u->parent->right = v;
+  if(v)
+    v->parent = u->parent;
+}
+
+// Remove n from the tree.
+void
+rb_erase(struct rbroot *root, struct rbnode *n)
+{
+  struct rbnode *y, *x, *p, *w;
+  int wasred;
+
+  // unlink n, or its successor if n has two children.
+  // x is the node that moved into the hole, which may
+  // be null, and p is x's parent.
+  wasred = n->red;
+  if(n->left == 0){
+    x = n->right;
+    p = n->parent;
+    transplant(root, n, n->right);
+  } else if(n->right == 0){
+    x = n->left;
+    p = n->parent;
+    transplant(root, n, n->left);
+  } else {
+    for(y = n->right; y->left; y = y->left)
+      ;
+    wasred = y->red;
+    x = y->right;
+    if(y->parent == n){
+      p = y;
+    } else {
+      p = y->parent;
+      transplant(root, y, y->right);
+      y->right = n->right;
+      y->right->parent = y;
+    }
+    transplant(root, n, y);
+    y->left = n->left;
+    y->left->parent = y;
+    y->red = n->red;
+  }
+  n->parent = n->left = n->right = 0;
+
+  if(wasred)
+    return;
+
+  // a black node left the path through x;
+  // push the missing black up or rotate it in.
+  while(x != root->node && !isred(x)){
+    if(x == p->left){
+      w = p->right;
+      if(w->red){
+        w->red = 0;
+        p->red = 1;
+        rotate_left(root, p);
+        w = p->right;
+      }
+      if(!isred(w->left) && !isred(w->right)){
+        w->red = 1;
+        x = p;
+        p = x->parent;
+      } else {
+        if(!isred(w->right)){
+          w->left->red = 0;
+          w->red = 1;
+          rotate_right(root, w);
+          w = p->right;
+        }
+        w->red = p->red;
+        p->red = 0;
+        w->right->red = 0;
+        rotate_left(root, p);
+        x = root->node;
+      }
+    } else {
+      w = p->left;
+      if(w->red){
+        w->red = 0;
+        p->red = 1;
+        rotate_right(root, p);
+        w = p->left;
+      }
+      if(!isred(w->left) && !isred(w->right)){
+        w->red = 1;
+        x = p;
+        p = x->parent;
+      } else {
+        if(!isred(w->left)){
+          w->right->red = 0;
+          w->red = 1;
+          rotate_left(root, w);
+          w = p->left;
+        }
+        w->red = p->red;
+        p->red = 0;
+        w->left->red = 0;
+        rotate_right(root, p);
+        x = root->node;
+      }
+    }
+  }
+  if(x)
+    x->red = 0;
+}
+
+// Return the smallest node, or 0 if the tree is empty.
+struct rbnode*
+rb_first(struct rbroot *root)
+{
+  struct rbnode *n = root->node;
+
+  if(n == 0)
+    return 0;
+  while(n->left)
+    n = n->left;
+  return n;
+}
+
+// Return the node after n in order, or 0.
+struct rbnode*
+rb_next(struct rbnode *n)
+{
+  struct rbnode *p;
+
+  if(n->right){
+    for(n = n->right; n->left; n = n->left)
+      ;
+    return n;
+  }
+  while((p = n->parent) != 0 && n == p->right)
+    n = p;
+  return p;
+}
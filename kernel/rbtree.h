@@ -0,0 +1,15 @@
+// Red-black tree node, embedded in the structure it orders.
+struct rbnode {
+  struct rbnode *parent;
+  struct rbnode *left;
+  struct rbnode *right;
+  int red;
+};
+
+struct rbroot {
+  struct rbnode *node;
+};
+
+// Get from an embedded node back to the containing structure.
+#define rb_entry(n, type, member) \
+  ((type *)((char *)(n) - (uint64)&((type *)0)->member))
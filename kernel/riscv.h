@@ -279,6 +279,14 @@ intr_get()
   return (x & SSTATUS_SIE) != 0;
 }
 
+// halt until an interrupt is pending, even if
+// interrupts are disabled.
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 static inline uint64
 r_sp()
 {
@@ -331,6 +339,8 @@ sfence_vma()
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_D (1L << 7) // dirty: written since mapped
+#define PTE_COW (1L << 8) // copy-on-write; a software (RSW) bit
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
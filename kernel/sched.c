@@ -0,0 +1,821 @@
+// Scheduling policies.
+//
+// Each process belongs to one policy (p->policy), and each
+// run queue holds processes of every policy side by side.
+// runq_add() and runq_pop() in proc.c call through the
+// policy's struct sched_class to keep its processes in
+// order; the policies take turns picking who runs next.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "rbtree.h"
+#include "proc.h"
+#include "sched.h"
+#include "defs.h"
+
+// Policy of init, and of processes created by the kernel.
+// SCHEDFLAG in the Makefile picks the one it boots with;
+// sched_setpolicy() can change it.
+#if defined(FCFS)
+int sched_default = SCHED_FCFS;
+#elif defined(SRT)
+int sched_default = SCHED_SRT;
+#elif defined(CFSD)
+int sched_default = SCHED_CFSD;
+#elif defined(MLFQ)
+int sched_default = SCHED_MLFQ;
+#else
+int sched_default = SCHED_DEFAULT;
+#endif
+
+// Time slice of each priority, in ticks: short for
+// interactive processes, which get the cpu back soon after
+// waking, and long for batch ones, which then lose it to
+// context switches less often.
+static const int prio_to_slice[] = {
+  [TEST_HIGH] 1,
+  [HIGH]      2,
+  [NORMAL]    QUANTUM,
+  [LOW]       10,
+  [TEST_LOW]  20,
+};
+
+// Preempt the running process once it has used up its
+// slice, counted from when it was dispatched rather than
+// from the last multiple of the slice, so a process that
+// only just got the cpu keeps it for a full slice.
+static int
+slice_tick(struct proc *p)
+{
+  return r_time() - p->dispatched >= (uint64)prio_to_slice[p->priority] * TICKCYCLES;
+}
+
+// Insert p in list l ahead of the first process it should
+// run before; processes that before() considers equal, or
+// all of them if before is 0, keep the order in which they
+// became RUNNABLE.
+static void
+list_insert(struct proclist *l, struct proc *p, int (*before)(struct proc*, struct proc*))
+{
+  struct proc **pp;
+
+  if(l->tail == 0 || before == 0 || !before(p, l->tail)){
+    // common case: p goes last.
+    p->rqnext = 0;
+    if(l->tail)
+      l->tail->rqnext = p;
+    else
+      l->head = p;
+    l->tail = p;
+  } else {
+    for(pp = &l->head; !before(p, *pp); pp = &(*pp)->rqnext)
+      ;
+    p->rqnext = *pp;
+    *pp = p;
+  }
+}
+
+static void
+list_remove(struct proclist *l, struct proc *p)
+{
+  struct proc **pp, *prev = 0;
+
+  for(pp = &l->head; *pp; prev = *pp, pp = &(*pp)->rqnext){
+    if(*pp == p){
+      *pp = p->rqnext;
+      if(l->tail == p)
+        l->tail = prev;
+      p->rqnext = 0;
+      return;
+    }
+  }
+  panic("list_remove");
+}
+
+static struct proc*
+list_pop(struct proclist *l)
+{
+  struct proc *p = l->head;
+
+  if(p){
+    l->head = p->rqnext;
+    if(l->head == 0)
+      l->tail = 0;
+    p->rqnext = 0;
+  }
+  return p;
+}
+
+// The list policies keep their processes on a list
+// of their own in each run queue, rq->list[p->policy].
+static void
+list_dequeue(struct runq *rq, struct proc *p)
+{
+  list_remove(&rq->list[p->policy], p);
+}
+
+// DEFAULT: round robin.
+
+static void
+rr_enqueue(struct runq *rq, struct proc *p)
+{
+  list_insert(&rq->list[SCHED_DEFAULT], p, 0);
+}
+
+static struct proc*
+rr_pick_next(struct runq *rq)
+{
+  return list_pop(&rq->list[SCHED_DEFAULT]);
+}
+
+// FCFS: in the order processes became RUNNABLE,
+// each running until it gives up the cpu.
+
+static int
+fcfs_before(struct proc *a, struct proc *b)
+{
+  return a->runnabletime < b->runnabletime;
+}
+
+static void
+fcfs_enqueue(struct runq *rq, struct proc *p)
+{
+  list_insert(&rq->list[SCHED_FCFS], p, fcfs_before);
+}
+
+static struct proc*
+fcfs_pick_next(struct runq *rq)
+{
+  return list_pop(&rq->list[SCHED_FCFS]);
+}
+
+// SRT: shortest remaining time first. A process is
+// expected to run for its predicted burst (see sleep()),
+// less what it has already run of the current one. The
+// queue is a binary min-heap of remaining times, and each
+// process keeps its index in it, so a process can be
+// taken out from the middle. The heap is an array in
+// pages; srt_reserve() sees that it never runs out.
+
+#define HEAP(rq, i) ((rq)->heap[(i) / HEAPPAGE][(i) % HEAPPAGE])
+
+static uint64
+srt_left(struct proc *p)
+{
+  return p->burst < p->burst_pred ? p->burst_pred - p->burst : 0;
+}
+
+static void
+heap_set(struct runq *rq, int i, struct proc *p)
+{
+  HEAP(rq, i) = p;
+  p->heapidx = i;
+}
+
+// Move the process at i up or down until the
+// heap is in order again.
+static void
+heap_fix(struct runq *rq, int i)
+{
+  struct proc *p = HEAP(rq, i);
+  uint64 left = srt_left(p);
+  int child;
+
+  while(i > 0 && left < srt_left(HEAP(rq, (i-1)/2))){
+    heap_set(rq, i, HEAP(rq, (i-1)/2));
+    i = (i-1)/2;
+  }
+  for(;;){
+    child = 2*i + 1;
+    if(child >= rq->nheap)
+      break;
+    if(child+1 < rq->nheap && srt_left(HEAP(rq, child+1)) < srt_left(HEAP(rq, child)))
+      child++;
+    if(srt_left(HEAP(rq, child)) >= left)
+      break;
+    heap_set(rq, i, HEAP(rq, child));
+    i = child;
+  }
+  heap_set(rq, i, p);
+}
+
+static void
+srt_enqueue(struct runq *rq, struct proc *p)
+{
+  heap_set(rq, rq->nheap++, p);
+  heap_fix(rq, p->heapidx);
+}
+
+static void
+srt_dequeue(struct runq *rq, struct proc *p)
+{
+  int i = p->heapidx;
+
+  rq->nheap--;
+  if(i != rq->nheap){
+    heap_set(rq, i, HEAP(rq, rq->nheap));
+    heap_fix(rq, i);
+  }
+}
+
+static struct proc*
+srt_pick_next(struct runq *rq)
+{
+  struct proc *p;
+
+  if(rq->nheap == 0)
+    return 0;
+  p = HEAP(rq, 0);
+  srt_dequeue(rq, p);
+  return p;
+}
+
+// Make sure every run queue's heap has room for n
+// processes: a queue can hold at most all of them.
+// Caller must hold free_lock (see allocproc()).
+int
+srt_reserve(int n)
+{
+  struct runq *rq;
+  struct cpu *c;
+  char *page;
+
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    rq = &c->runq;
+    while(rq->heapcap < n){
+      if((page = kalloc()) == 0)
+        return -1;
+      rq->heap[rq->heapcap / HEAPPAGE] = (struct proc**)page;
+      rq->heapcap += HEAPPAGE;
+    }
+  }
+  return 0;
+}
+
+// Give back heap pages that n processes don't need,
+// keeping half a page spare so that a process coming and
+// going doesn't free and allocate a page each time.
+// Caller must hold free_lock (see freeproc()).
+void
+srt_shrink(int n)
+{
+  struct runq *rq;
+  struct cpu *c;
+
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    rq = &c->runq;
+    if(rq->heapcap - (int)HEAPPAGE < n + (int)HEAPPAGE / 2)
+      continue;
+    acquire(&rq->lock);
+    while(rq->heapcap - (int)HEAPPAGE >= n + (int)HEAPPAGE / 2 &&
+          rq->heapcap - (int)HEAPPAGE >= rq->nheap){
+      rq->heapcap -= HEAPPAGE;
+      kfree(rq->heap[rq->heapcap / HEAPPAGE]);
+      rq->heap[rq->heapcap / HEAPPAGE] = 0;
+    }
+    release(&rq->lock);
+  }
+}
+
+// curr's fields are read without its lock; the
+// answer is only a hint.
+static int
+srt_preempt(struct proc *p, struct proc *curr)
+{
+  uint64 ran = curr->burst + (r_time() - curr->dispatched);
+
+  return ran < curr->burst_pred && srt_left(p) < curr->burst_pred - ran;
+}
+
+// CFSD: smallest weighted run time first, from a
+// red-black tree keyed by vruntime.
+
+// CFS load weight of each priority. A process's vruntime
+// advances by NICE_0_WEIGHT/weight times its run time, so
+// like the old CFSD ratio it is scaled by priority/NORMAL.
+// wmult is (NICE_0_WEIGHT << 16)/weight, which turns the
+// division into a multiply and shift.
+#define NICE_0_WEIGHT 1024
+static const struct {
+  int weight;
+  uint64 wmult;
+} prio_to_weight[] = {
+  [TEST_HIGH] { 5120,  13107 },
+  [HIGH]      { 1707,  39314 },
+  [NORMAL]    { 1024,  65536 },
+  [LOW]       {  731,  91804 },
+  [TEST_LOW]  {  205, 327360 },
+};
+
+// How far behind min_vruntime a woken sleeper may be placed:
+// enough to run soon after waking, not enough to hog the cpu.
+#define SLEEPER_CREDIT (QUANTUM * TICKCYCLES / 2)
+
+// How far a woken process's vruntime must be behind the
+// running process's before it preempts it.
+#define WAKEUP_GRAN TICKCYCLES
+
+static int
+vruntime_less(struct rbnode *a, struct rbnode *b)
+{
+  return rb_entry(a, struct proc, rbnode)->vruntime <
+         rb_entry(b, struct proc, rbnode)->vruntime;
+}
+
+static void
+cfs_enqueue(struct runq *rq, struct proc *p)
+{
+  rb_insert(&rq->tree, &p->rbnode, vruntime_less);
+}
+
+static void
+cfs_dequeue(struct runq *rq, struct proc *p)
+{
+  rb_erase(&rq->tree, &p->rbnode);
+}
+
+static struct proc*
+cfs_pick_next(struct runq *rq)
+{
+  struct rbnode *n = rb_first(&rq->tree);
+  struct proc *p;
+
+  if(n == 0)
+    return 0;
+  p = rb_entry(n, struct proc, rbnode);
+  rb_erase(&rq->tree, n);
+  if(p->vruntime > rq->min_vruntime)
+    rq->min_vruntime = p->vruntime;
+  return p;
+}
+
+// Set the vruntime of a process about to join p->cpu's
+// queue after being created or after sleeping. A new
+// process starts level with the queue; a sleeper keeps
+// its own vruntime unless it fell too far behind.
+static void
+cfs_place(struct proc *p, int new)
+{
+  uint64 min = p->cpu->runq.min_vruntime;
+
+  if(new)
+    p->vruntime = min;
+  else if(min > SLEEPER_CREDIT && p->vruntime < min - SLEEPER_CREDIT)
+    p->vruntime = min - SLEEPER_CREDIT;
+}
+
+static void
+cfs_start(struct proc *p)
+{
+  p->exec_start = r_time();
+}
+
+// Charge the running process p for the cycles since
+// it was dispatched.
+static void
+cfs_stop(struct proc *p)
+{
+  uint64 now = r_time();
+
+  p->vruntime += ((now - p->exec_start) * prio_to_weight[p->priority].wmult) >> 16;
+  p->exec_start = now;
+}
+
+// vruntime is only meaningful relative to the min_vruntime
+// of the queue it came from; rebase it onto to's. Called
+// with both queues locked.
+static void
+cfs_migrate(struct proc *p, struct runq *from, struct runq *to)
+{
+  p->vruntime += to->min_vruntime;
+  if(p->vruntime > from->min_vruntime)
+    p->vruntime -= from->min_vruntime;
+  else
+    p->vruntime = 0;
+}
+
+// curr's fields are read without its lock; the
+// answer is only a hint.
+static int
+cfs_preempt(struct proc *p, struct proc *curr)
+{
+  uint64 vruntime = curr->vruntime +
+    (((r_time() - curr->exec_start) * prio_to_weight[curr->priority].wmult) >> 16);
+
+  return p->vruntime + WAKEUP_GRAN < vruntime;
+}
+
+// MLFQ: a process starts at the top level and drops a
+// level each time it uses up its whole slice there, over
+// however many runs, so CPU-bound processes sink even if
+// they block just before the slice ends. Ones that block
+// having used less than half of it, as interactive ones
+// do, rise again (see mlfq_place()).
+// Lower levels run only when the levels above are empty,
+// but get longer slices. Every MLFQ_BOOST ticks, everyone
+// goes back to the top so sunken processes can't starve.
+//
+// A boost is lazy: it starts a new epoch, and a process
+// whose p->epoch is older is at level 0 whatever p->level
+// says. A run queue moves its lower levels onto level 0
+// the next time it is used in the new epoch.
+
+#define MLFQ_BOOST 50
+
+// Slice at each level, in ticks.
+static const int mlfq_slice[NMLFQ] = { 1, 2, 4, 8 };
+
+static uint
+mlfq_epoch(void)
+{
+  return ticks / MLFQ_BOOST;
+}
+
+// Put p at level, with none of its slice there used.
+static void
+mlfq_move(struct proc *p, int level)
+{
+  p->level = level;
+  p->levelused = 0;
+}
+
+// p's level, catching up with a boost if one happened.
+static int
+mlfq_level(struct proc *p)
+{
+  uint epoch = mlfq_epoch();
+
+  if(p->epoch != epoch){
+    p->epoch = epoch;
+    mlfq_move(p, 0);
+  }
+  return p->level;
+}
+
+// If a boost happened since rq was last used, move
+// every level onto the end of level 0.
+static void
+mlfq_boost(struct runq *rq)
+{
+  uint epoch = mlfq_epoch();
+  struct proclist *top = &rq->mlfq[0], *l;
+
+  if(rq->mlfqepoch == epoch)
+    return;
+  rq->mlfqepoch = epoch;
+  for(l = &rq->mlfq[1]; l < &rq->mlfq[NMLFQ]; l++){
+    if(l->head == 0)
+      continue;
+    if(top->tail)
+      top->tail->rqnext = l->head;
+    else
+      top->head = l->head;
+    top->tail = l->tail;
+    l->head = l->tail = 0;
+  }
+  rq->mlfqmap = top->head ? 1 : 0;
+}
+
+// Index of the lowest set bit of a non-zero map, in
+// constant time: x & -x isolates the bit, and the de
+// Bruijn multiply puts a unique pattern in the top 5 bits.
+static int
+lowbit(uint x)
+{
+  static const char debruijn[32] = {
+    0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+    31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+  };
+
+  return debruijn[((x & -x) * 0x077CB531U) >> 27];
+}
+
+// Charge the cycles since p was last charged to its level.
+static void
+mlfq_charge(struct proc *p)
+{
+  uint64 now = r_time();
+
+  p->leveltime[p->level] += now - p->exec_start;
+  p->levelused += now - p->exec_start;
+  p->exec_start = now;
+}
+
+// If p has used up its level's slice, move it down a
+// level, or at the bottom start it a new slice, and
+// return 1. p must not be on a run queue.
+static int
+mlfq_demote(struct proc *p)
+{
+  int level = mlfq_level(p);
+
+  if(p->levelused < (uint64)mlfq_slice[level] * TICKCYCLES)
+    return 0;
+  mlfq_move(p, level < NMLFQ-1 ? level + 1 : level);
+  return 1;
+}
+
+static void
+mlfq_enqueue(struct runq *rq, struct proc *p)
+{
+  int level;
+
+  mlfq_boost(rq);
+  level = mlfq_level(p);
+  list_insert(&rq->mlfq[level], p, 0);
+  rq->mlfqmap |= 1 << level;
+}
+
+static void
+mlfq_dequeue(struct runq *rq, struct proc *p)
+{
+  int level;
+
+  mlfq_boost(rq);
+  // a process queued before the boost is on level 0 now.
+  level = p->epoch == rq->mlfqepoch ? p->level : 0;
+  list_remove(&rq->mlfq[level], p);
+  if(rq->mlfq[level].head == 0)
+    rq->mlfqmap &= ~(1 << level);
+}
+
+static struct proc*
+mlfq_pick_next(struct runq *rq)
+{
+  struct proc *p;
+  int level;
+
+  mlfq_boost(rq);
+  if(rq->mlfqmap == 0)
+    return 0;
+  level = lowbit(rq->mlfqmap);
+  p = list_pop(&rq->mlfq[level]);
+  if(rq->mlfq[level].head == 0)
+    rq->mlfqmap &= ~(1 << level);
+  return p;
+}
+
+// A new process starts at the top. One that blocked
+// having used less than half its slice: move it up.
+static void
+mlfq_place(struct proc *p, int new)
+{
+  int level;
+
+  if(new){
+    p->epoch = mlfq_epoch();
+    mlfq_move(p, 0);
+  } else if((level = mlfq_level(p)) > 0 &&
+            p->levelused < (uint64)mlfq_slice[level] * TICKCYCLES / 2){
+    mlfq_move(p, level - 1);
+  }
+}
+
+static void
+mlfq_start(struct proc *p)
+{
+  mlfq_level(p);
+  p->exec_start = r_time();
+}
+
+// Leaving the cpu: demote p if it used up its slice,
+// even if it is going to sleep with its slice all but
+// done.
+static void
+mlfq_stop(struct proc *p)
+{
+  mlfq_charge(p);
+  mlfq_demote(p);
+}
+
+// Preempt p when it has used up its level's slice,
+// and move it down a level.
+static int
+mlfq_tick(struct proc *p)
+{
+  mlfq_charge(p);
+  return mlfq_demote(p);
+}
+
+static int
+mlfq_preempt(struct proc *p, struct proc *curr)
+{
+  return p->level < curr->level;
+}
+
+// EDF: earliest absolute deadline first, ahead of every
+// other policy. A process asks for dl_runtime cycles of cpu
+// in each dl_period, done within dl_deadline of the start
+// of the period (see sched_setdeadline()). Admission keeps
+// the total of runtime/period over all EDF processes within
+// NCPU. Since each cpu has its own queue, that bounds the
+// load rather than guaranteeing every deadline; misses are
+// counted in p->misses.
+//
+// Bandwidth is enforced as in a constant bandwidth server:
+// a process that uses up its budget is throttled until its
+// deadline (see sched_throttle()), and a process that wakes
+// with more budget than it can use at its bandwidth before
+// its deadline gets a fresh budget and deadline instead.
+
+struct spinlock edf_lock;
+uint edf_bw;                  // Sum of dl_bw of EDF processes.
+
+static int
+deadline_less(struct rbnode *a, struct rbnode *b)
+{
+  return rb_entry(a, struct proc, rbnode)->deadline <
+         rb_entry(b, struct proc, rbnode)->deadline;
+}
+
+// Charge the cycles since p was last charged to its budget.
+static void
+edf_charge(struct proc *p)
+{
+  uint64 now = r_time();
+  uint64 ran = now - p->exec_start;
+
+  p->dl_left = ran < p->dl_left ? p->dl_left - ran : 0;
+  p->exec_start = now;
+  if(now > p->deadline && !p->missed){
+    p->missed = 1;
+    p->misses++;
+  }
+}
+
+static void
+edf_enqueue(struct runq *rq, struct proc *p)
+{
+  rb_insert(&rq->dltree, &p->rbnode, deadline_less);
+}
+
+static void
+edf_dequeue(struct runq *rq, struct proc *p)
+{
+  rb_erase(&rq->dltree, &p->rbnode);
+}
+
+static struct proc*
+edf_pick_next(struct runq *rq)
+{
+  struct rbnode *n = rb_first(&rq->dltree);
+
+  if(n == 0)
+    return 0;
+  rb_erase(&rq->dltree, n);
+  return rb_entry(n, struct proc, rbnode);
+}
+
+// Start a new job, or keep the current one if p can use
+// what is left of its budget by its deadline without
+// exceeding its bandwidth: dl_left/(deadline-now) <= bw.
+static void
+edf_place(struct proc *p, int new)
+{
+  uint64 now = r_time();
+
+  if(new || now >= p->deadline ||
+     p->dl_left * p->dl_period > p->dl_runtime * (p->deadline - now)){
+    p->deadline = now + p->dl_deadline;
+    p->dl_left = p->dl_runtime;
+    p->missed = 0;
+  }
+}
+
+static void
+edf_start(struct proc *p)
+{
+  p->exec_start = r_time();
+}
+
+static void
+edf_stop(struct proc *p)
+{
+  edf_charge(p);
+}
+
+static void
+edf_leave(struct proc *p)
+{
+  acquire(&edf_lock);
+  edf_bw -= p->dl_bw;
+  release(&edf_lock);
+  p->dl_bw = 0;
+}
+
+// EDF processes are not time sliced; a process with an
+// earlier deadline preempts on wakeup. Stop p only when
+// its budget is gone.
+static int
+edf_tick(struct proc *p)
+{
+  edf_charge(p);
+  if(p->dl_left > 0)
+    return 0;
+  p->throttled = 1;
+  return 1;
+}
+
+static int
+edf_preempt(struct proc *p, struct proc *curr)
+{
+  return p->deadline < curr->deadline;
+}
+
+// Reserve bandwidth bw for p, in place of what it has.
+// Returns -1 if that would take EDF processes past the
+// capacity of the machine. Caller must hold p->lock.
+int
+edf_admit(struct proc *p, uint bw)
+{
+  acquire(&edf_lock);
+  if(edf_bw - p->dl_bw + bw > (NCPU << 16)){
+    release(&edf_lock);
+    return -1;
+  }
+  edf_bw = edf_bw - p->dl_bw + bw;
+  release(&edf_lock);
+  p->dl_bw = bw;
+  return 0;
+}
+
+void
+sched_init(void)
+{
+  initlock(&edf_lock, "edf");
+}
+
+static struct sched_class rr_class = {
+  .name = "default",
+  .enqueue = rr_enqueue,
+  .dequeue = list_dequeue,
+  .pick_next = rr_pick_next,
+  .tick = slice_tick,
+};
+
+static struct sched_class fcfs_class = {
+  .name = "fcfs",
+  .enqueue = fcfs_enqueue,
+  .dequeue = list_dequeue,
+  .pick_next = fcfs_pick_next,
+};
+
+static struct sched_class srt_class = {
+  .name = "srt",
+  .enqueue = srt_enqueue,
+  .dequeue = srt_dequeue,
+  .pick_next = srt_pick_next,
+  .tick = slice_tick,
+  .preempt = srt_preempt,
+};
+
+static struct sched_class cfs_class = {
+  .name = "cfsd",
+  .enqueue = cfs_enqueue,
+  .dequeue = cfs_dequeue,
+  .pick_next = cfs_pick_next,
+  .place = cfs_place,
+  .start = cfs_start,
+  .stop = cfs_stop,
+  .migrate = cfs_migrate,
+  .tick = slice_tick,
+  .preempt = cfs_preempt,
+};
+
+static struct sched_class mlfq_class = {
+  .name = "mlfq",
+  .enqueue = mlfq_enqueue,
+  .dequeue = mlfq_dequeue,
+  .pick_next = mlfq_pick_next,
+  .place = mlfq_place,
+  .start = mlfq_start,
+  .stop = mlfq_stop,
+  .tick = mlfq_tick,
+  .preempt = mlfq_preempt,
+};
+
+static struct sched_class edf_class = {
+  .name = "edf",
+  .realtime = 1,
+  .enqueue = edf_enqueue,
+  .dequeue = edf_dequeue,
+  .pick_next = edf_pick_next,
+  .place = edf_place,
+  .start = edf_start,
+  .stop = edf_stop,
+  .leave = edf_leave,
+  .tick = edf_tick,
+  .preempt = edf_preempt,
+};
+
+struct sched_class *sched_class[NSCHED] = {
+[SCHED_DEFAULT] &rr_class,
+[SCHED_FCFS]    &fcfs_class,
+[SCHED_SRT]     &srt_class,
+[SCHED_CFSD]    &cfs_class,
+[SCHED_MLFQ]    &mlfq_class,
+[SCHED_EDF]     &edf_class,
+};
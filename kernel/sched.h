@@ -0,0 +1,7 @@
+// Scheduling policies, for sched_setpolicy().
+#define SCHED_DEFAULT 0  // round robin
+#define SCHED_FCFS    1  // first come first served, never preempted
+#define SCHED_SRT     2  // shortest predicted burst first
+#define SCHED_CFSD    3  // fair share of the cpu, weighted by priority
+#define SCHED_MLFQ    4  // multi-level feedback queue
+#define SCHED_EDF     5  // earliest deadline first; see sched_setdeadline()
@@ -0,0 +1,274 @@
+// Object caches, for kernel structures smaller than a page.
+//
+// A cache hands out objects of one size, packed into
+// pages called slabs. Each slab starts with a struct
+// slab, so a freed object finds its slab by rounding its
+// address down. Slabs with free objects are kept on the
+// cache's partial list; a slab whose objects are all
+// free goes back to kalloc().
+//
+// Each cpu keeps a magazine of free objects per cache,
+// so that most allocations and frees take no lock.
+// An empty magazine is half filled from the slabs, and
+// a full one returns half its objects, under the
+// cache's lock. When memory runs short, each cpu
+// returns all of them (see reclaim() in proc.c).
+//
+// kmalloc() serves odd sizes from a cache for each
+// power of two from 16 bytes up to 2048.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "slab.h"
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;          // Next in cache->partial
+  struct slab **pprev;        // Link pointing at this slab; 0 if full
+  void *free;                 // Free objects, linked through their first word
+  int nfree;
+};
+
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+#define KMALLOCMIN 4          // smallest kmalloc() cache is 2^4 bytes
+#define NKMALLOC   8          // and the largest 2^(4+7)
+
+static struct kmem_cache cache_cache;   // the struct kmem_caches
+static struct kmem_cache *kmalloc_cache[NKMALLOC];
+static struct kmem_cache *caches;       // all caches, for slabdump()
+static struct spinlock caches_lock;
+
+static void
+cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  memset(c, 0, sizeof(*c));
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  if(c->size > PGSIZE - SLABHDR)
+    panic("kmem_cache_create: too big");
+  c->perslab = (PGSIZE - SLABHDR) / c->size;
+  initlock(&c->lock, "kmem_cache");
+
+  acquire(&caches_lock);
+  c->next = caches;
+  caches = c;
+  release(&caches_lock);
+}
+
+// Create a cache of objects of the given size.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  if((c = kmem_cache_alloc(&cache_cache)) == 0)
+    panic("kmem_cache_create");
+  cache_init(c, name, size);
+  return c;
+}
+
+void
+slabinit(void)
+{
+  static char *names[NKMALLOC] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+  };
+  int i;
+
+  initlock(&caches_lock, "caches");
+  cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache));
+  for(i = 0; i < NKMALLOC; i++)
+    kmalloc_cache[i] = kmem_cache_create(names[i], 1 << (KMALLOCMIN + i));
+}
+
+static void
+partial_insert(struct kmem_cache *c, struct slab *s)
+{
+  s->next = c->partial;
+  if(s->next)
+    s->next->pprev = &s->next;
+  c->partial = s;
+  s->pprev = &c->partial;
+}
+
+static void
+partial_remove(struct slab *s)
+{
+  *s->pprev = s->next;
+  if(s->next)
+    s->next->pprev = s->pprev;
+  s->next = 0;
+  s->pprev = 0;
+}
+
+// Carve a new page into a slab of free objects.
+// Caller must hold c->lock.
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+  int i;
+
+  if((s = kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->free = 0;
+  obj = (char*)s + SLABHDR + (c->perslab - 1) * c->size;
+  for(i = 0; i < c->perslab; i++, obj -= c->size){
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  s->nfree = c->perslab;
+  partial_insert(c, s);
+  c->nslab++;
+  return s;
+}
+
+// Take up to n objects from c's slabs into obj[].
+// Return how many were taken.
+static int
+slab_get(struct kmem_cache *c, void **obj, int n)
+{
+  struct slab *s;
+  int i;
+
+  acquire(&c->lock);
+  for(i = 0; i < n; i++){
+    if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+      break;
+    obj[i] = s->free;
+    s->free = *(void**)s->free;
+    if(--s->nfree == 0)
+      partial_remove(s);
+  }
+  release(&c->lock);
+  return i;
+}
+
+// Return n objects in obj[] to their slabs.
+static void
+slab_put(struct kmem_cache *c, void **obj, int n)
+{
+  struct slab *s;
+  int i;
+
+  acquire(&c->lock);
+  for(i = 0; i < n; i++){
+    s = (struct slab*)PGROUNDDOWN((uint64)obj[i]);
+    if(s->cache != c)
+      panic("kmem_cache_free");
+    *(void**)obj[i] = s->free;
+    s->free = obj[i];
+    if(s->nfree++ == 0)
+      partial_insert(c, s);
+    if(s->nfree == c->perslab){
+      partial_remove(s);
+      c->nslab--;
+      kfree(s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from c. Its contents are junk.
+// Returns 0 if memory runs out.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj = 0;
+
+  // interrupts stay off so that we stay on this cpu.
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0)
+    m->n = slab_get(c, m->obj, MAGSIZE / 2);
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+
+  if(obj)
+    __sync_fetch_and_add(&c->inuse, 1);
+  return obj;
+}
+
+// Free an object allocated from c.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    slab_put(c, &m->obj[MAGSIZE / 2], MAGSIZE / 2);
+    m->n = MAGSIZE / 2;
+  }
+  m->obj[m->n++] = obj;
+  pop_off();
+
+  __sync_fetch_and_sub(&c->inuse, 1);
+}
+
+// Return this cpu's magazines to the slabs, so that the
+// slabs can go back to kalloc(). Called with interrupts
+// off, when memory runs short.
+void
+slabidle(void)
+{
+  struct kmem_cache *c;
+  struct magazine *m;
+
+  acquire(&caches_lock);
+  for(c = caches; c; c = c->next){
+    m = &c->mag[cpuid()];
+    if(m->n > 0){
+      slab_put(c, m->obj, m->n);
+      m->n = 0;
+    }
+  }
+  release(&caches_lock);
+}
+
+// Allocate n bytes from the smallest kmalloc cache that fits.
+// Returns 0 if n is too big or memory runs out.
+void*
+kmalloc(uint n)
+{
+  int i;
+
+  for(i = 0; i < NKMALLOC; i++)
+    if(n <= (1 << (KMALLOCMIN + i)))
+      return kmem_cache_alloc(kmalloc_cache[i]);
+  return 0;
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *p)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)p);
+
+  kmem_cache_free(s->cache, p);
+}
+
+// Print each cache's objects in use and pages held.
+// For ^P on the console.
+void
+slabdump(void)
+{
+  struct kmem_cache *c;
+
+  acquire(&caches_lock);
+  for(c = caches; c; c = c->next)
+    printf("%s: %d in use, %d slabs of %d\n",
+           c->name, c->inuse, c->nslab, c->perslab);
+  release(&caches_lock);
+}
@@ -0,0 +1,22 @@
+// Caches of same-sized kernel objects (see slab.c).
+
+#define MAGSIZE 16            // objects in a per-cpu magazine
+
+// A cpu's stack of free objects, taken and returned
+// without locking, with interrupts off.
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;                  // Object size, rounded up for alignment
+  int perslab;                // Objects in each slab page
+  struct spinlock lock;       // protects partial and nslab
+  struct slab *partial;       // Slabs with some objects free
+  int nslab;                  // Pages held
+  int inuse;                  // Objects handed out and not yet freed
+  struct magazine mag[NCPU];
+  struct kmem_cache *next;    // Next in the list of all caches
+};
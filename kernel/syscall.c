@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "syscall.h"
 #include "defs.h"
@@ -12,7 +13,8 @@ int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz)
+  uint64 sz = p->leader->sz;
+  if(addr >= sz || addr+sizeof(uint64) > sz)
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
     return -1;
@@ -107,6 +109,14 @@ extern uint64 sys_uptime(void);
 extern uint64 sys_trace(void);
 extern uint64 sys_wait_stat(void);
 extern uint64 sys_set_priority(void);
+extern uint64 sys_sched_setpolicy(void);
+extern uint64 sys_sched_setdeadline(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_futex_wait(void);
+extern uint64 sys_futex_wake(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
 
 
 static char* syscallnames [] = {
@@ -134,6 +144,14 @@ static char* syscallnames [] = {
 [SYS_trace]   "trace",
 [SYS_wait_stat]   "wait_stat",
 [SYS_set_priority] "set_priority",
+[SYS_sched_setpolicy] "sched_setpolicy",
+[SYS_sched_setdeadline] "sched_setdeadline",
+[SYS_clone]   "clone",
+[SYS_join]    "join",
+[SYS_futex_wait] "futex_wait",
+[SYS_futex_wake] "futex_wake",
+[SYS_mmap]    "mmap",
+[SYS_munmap]  "munmap",
 };
 
 
@@ -162,6 +180,14 @@ static uint64 (*syscalls[])(void) = {
 [SYS_trace]   sys_trace,
 [SYS_wait_stat]   sys_wait_stat,
 [SYS_set_priority] sys_set_priority,
+[SYS_sched_setpolicy] sys_sched_setpolicy,
+[SYS_sched_setdeadline] sys_sched_setdeadline,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
 };
 
 void
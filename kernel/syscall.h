@@ -22,4 +22,12 @@
 #define SYS_close  21
 #define SYS_trace 22
 #define SYS_wait_stat  23
-#define SYS_set_priority 24
\ No newline at end of file
+#define SYS_set_priority 24
+#define SYS_sched_setpolicy 25
+#define SYS_sched_setdeadline 26
+#define SYS_clone 27
+#define SYS_join 28
+#define SYS_futex_wait 29
+#define SYS_futex_wake 30
+#define SYS_mmap 31
+#define SYS_munmap 32
@@ -5,6 +5,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "syscall.h"
 
@@ -42,37 +43,21 @@ sys_wait(void)
 uint64
 sys_sbrk(void)
 {
-  int addr;
   int n;
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  
-  if(growproc(n) < 0)
-    return -1;
-  return addr;
+  return growproc(n);
 }
 
 uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return timer_sleep(n);
 }
 
 uint64
@@ -140,3 +125,86 @@ sys_set_priority(void)
     return -1;
   return set_priority(priority);
 }
+
+// set the scheduling policy of a process, or of all of them
+uint64
+sys_sched_setpolicy(void)
+{
+  int pid;
+  int policy;
+
+  if(argint(0, &pid) < 0)
+    return -1;
+
+  if(argint(1, &policy) < 0)
+    return -1;
+
+  return sched_setpolicy(pid, policy);
+}
+
+// make the current process a real-time (EDF) process
+uint64
+sys_sched_setdeadline(void)
+{
+  int runtime;
+  int deadline;
+  int period;
+
+  if(argint(0, &runtime) < 0)
+    return -1;
+
+  if(argint(1, &deadline) < 0)
+    return -1;
+
+  if(argint(2, &period) < 0)
+    return -1;
+
+  return sched_setdeadline(runtime, deadline, period);
+}
+
+uint64
+sys_clone(void)
+{
+  uint64 fn;
+  uint64 stack;
+  int flags;
+  uint64 arg;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &stack) < 0 ||
+     argint(2, &flags) < 0 || argaddr(3, &arg) < 0)
+    return -1;
+  return clone(fn, stack, flags, arg);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 p;
+
+  if(argint(0, &tid) < 0 || argaddr(1, &p) < 0)
+    return -1;
+  return join(tid, p);
+}
+
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futex_wait(addr, val);
+}
+
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futex_wake(addr, n);
+}
@@ -0,0 +1,228 @@
+// Kernel timers.
+//
+// Pending timers live in a hierarchical timing wheel.
+// Level 0 has one slot per tick for the next 64 ticks;
+// each level above has slots 64 times as wide as the
+// level below. A timer goes in the lowest level whose
+// span reaches its expiry, and moves down a level
+// ("cascades") when the level below wraps around to it.
+// Adding and deleting a timer is O(1), and a clock tick
+// only looks at timers that are due, plus a cascade
+// once every 64 ticks.
+//
+// Callbacks run from the clock interrupt with the wheel
+// lock held. They must be short, must not sleep, and
+// must not add or delete timers; wakeup() is fine.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "rbtree.h"
+#include "proc.h"
+#include "timer.h"
+#include "defs.h"
+
+#define WHEELBITS  6
+#define WHEELSIZE  (1 << WHEELBITS)
+#define WHEELMASK  (WHEELSIZE - 1)
+#define NLEVEL     4
+#define MAXDELTA   ((1U << (NLEVEL*WHEELBITS)) - 1)
+
+struct {
+  struct spinlock lock;
+  uint clk;                   // Next tick to process
+  struct timer *slot[NLEVEL][WHEELSIZE];
+  uint armed;                 // Tick idle hart 0 last halted until
+} wheel;
+
+void
+timer_init(void)
+{
+  initlock(&wheel.lock, "timer");
+}
+
+// Put t in the slot covering t->expires.
+// Caller must hold wheel.lock.
+static void
+enqueue(struct timer *t)
+{
+  uint delta = t->expires - wheel.clk;
+  uint when = t->expires;
+  struct timer **slot;
+  int level;
+
+  if((int)delta < 0){
+    // already due; run it on the next tick.
+    delta = 0;
+    when = wheel.clk;
+  } else if(delta > MAXDELTA){
+    // park it as far out as the wheel reaches;
+    // cascading will put it back in the right place.
+    delta = MAXDELTA;
+    when = wheel.clk + MAXDELTA;
+  }
+
+  for(level = 0; level < NLEVEL-1; level++)
+    if(delta < (1U << ((level+1)*WHEELBITS)))
+      break;
+  slot = &wheel.slot[level][(when >> (level*WHEELBITS)) & WHEELMASK];
+
+  t->next = *slot;
+  if(t->next)
+    t->next->pprev = &t->next;
+  *slot = t;
+  t->pprev = slot;
+}
+
+// t has just been added. If it is due before the tick
+// that hart 0 is halted until (see timer_next()), wake
+// hart 0 to rearm its timer, since no other hart may be
+// taking ticks. Caller must hold wheel.lock.
+static void
+wake0(struct timer *t)
+{
+  if(cpus[0].idle && (int)(t->expires - wheel.armed) < 0)
+    ipi(0);
+}
+
+// Take t out of the wheel. Caller must hold wheel.lock.
+static void
+dequeue(struct timer *t)
+{
+  *t->pprev = t->next;
+  if(t->next)
+    t->next->pprev = t->pprev;
+  t->next = 0;
+  t->pprev = 0;
+}
+
+// Re-file every timer in slot idx of level,
+// which the clock has just reached.
+static int
+cascade(int level, int idx)
+{
+  struct timer *t, *next;
+
+  t = wheel.slot[level][idx];
+  wheel.slot[level][idx] = 0;
+  for(; t; t = next){
+    next = t->next;
+    enqueue(t);
+  }
+  return idx;
+}
+
+// Arrange for t->fn(t->arg) to be called at tick expires.
+// t must be zeroed, or have run, or have been deleted.
+void
+timer_add(struct timer *t, uint expires)
+{
+  acquire(&wheel.lock);
+  if(t->pprev)
+    panic("timer_add");
+  t->expires = expires;
+  enqueue(t);
+  wake0(t);
+  release(&wheel.lock);
+}
+
+// Cancel t. Returns 1 if it was pending, 0 if it
+// had already run (or was never added). Either way,
+// the callback is not running when timer_del returns.
+int
+timer_del(struct timer *t)
+{
+  int pending;
+
+  acquire(&wheel.lock);
+  pending = t->pprev != 0;
+  if(pending)
+    dequeue(t);
+  release(&wheel.lock);
+  return pending;
+}
+
+// Run the timers that are due. Called by clockintr()
+// after it advances ticks.
+void
+timer_tick(void)
+{
+  struct timer *t, *next;
+  int idx, level;
+
+  acquire(&wheel.lock);
+  while((int)(ticks - wheel.clk) >= 0){
+    idx = wheel.clk & WHEELMASK;
+    for(level = 1; level < NLEVEL && idx == 0; level++)
+      idx = cascade(level, (wheel.clk >> (level*WHEELBITS)) & WHEELMASK);
+
+    t = wheel.slot[0][wheel.clk & WHEELMASK];
+    wheel.slot[0][wheel.clk & WHEELMASK] = 0;
+    for(; t; t = next){
+      next = t->next;
+      t->next = 0;
+      t->pprev = 0;
+      t->fn(t->arg);
+    }
+    wheel.clk++;
+  }
+  release(&wheel.lock);
+}
+
+// Return the tick by which the next timer is due: the
+// earliest timer in level 0 before it wraps, or the wrap
+// itself, when higher levels cascade. Idle hart 0 halts
+// until then; timers added meanwhile that are due sooner
+// wake it (see wake0()).
+uint
+timer_next(void)
+{
+  uint t;
+
+  acquire(&wheel.lock);
+  for(t = wheel.clk; wheel.slot[0][t & WHEELMASK] == 0; t++)
+    if(((t + 1) & WHEELMASK) == 0){
+      t++;
+      break;
+    }
+  wheel.armed = t;
+  release(&wheel.lock);
+  return t;
+}
+
+static void
+timer_wakeup(void *chan)
+{
+  wakeup(chan);
+}
+
+// Sleep for n ticks. The caller is woken once, by
+// its own timer, rather than on every tick.
+// Returns -1 if the process is killed first.
+int
+timer_sleep(int n)
+{
+  struct timer t;
+
+  if(n <= 0)
+    return 0;
+
+  t.fn = timer_wakeup;
+  t.arg = &t;
+  acquire(&wheel.lock);
+  t.expires = ticks + n;
+  enqueue(&t);
+  wake0(&t);
+  while(t.pprev){
+    if(myproc()->killed){
+      dequeue(&t);
+      release(&wheel.lock);
+      return -1;
+    }
+    sleep(&t, &wheel.lock);
+  }
+  release(&wheel.lock);
+  return 0;
+}
@@ -0,0 +1,10 @@
+// Kernel timer; see timer.c.
+struct timer {
+  uint expires;               // Tick at which fn is called
+  void (*fn)(void*);          // Called from the clock interrupt
+  void *arg;                  // Passed to fn
+
+  // the wheel lock must be held when using these:
+  struct timer *next;         // Next timer in the same slot
+  struct timer **pprev;       // Link pointing at this timer; 0 if not pending
+};
@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "defs.h"
 
@@ -38,14 +39,6 @@ usertrap(void)
 {
   int which_dev = 0;
 
-  #ifndef FCFS
-  int time;
-
-  acquire(&tickslock);
-  time = (int)ticks;
-  release(&tickslock);
-  #endif
-
   if((r_sstatus() & SSTATUS_SPP) != 0)
     panic("usertrap: not from user mode");
 
@@ -73,6 +66,29 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // fetch, load or store to a page of the program not
+    // read in yet, or not touched since sbrk(), or store
+    // to a copy-on-write page.
+    uint64 scause = r_scause();
+    uint64 va = r_stval();
+    int access = scause == 12 ? PTE_X : scause == 13 ? PTE_R : PTE_W;
+
+    // reading the program's page in may sleep.
+    intr_on();
+
+    uint nshort = kshortage();
+    int r = pagefault(p->pagetable, va, access);
+    if(r < 0 && kshortage() != nshort){
+      // out of memory: give back cached memory, and retry.
+      reclaim();
+      r = pagefault(p->pagetable, va, access);
+    }
+    if(r < 0){
+      printf("usertrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, va);
+      p->killed = 1;
+    }
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -84,15 +100,16 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-
-  #ifdef FCFS
-  // do not yield
-  #else
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && time % QUANTUM == 0) // timeintr every QUANTUM ticks
-    yield();
-  #endif
-  
+  // give up the CPU if the timer interrupt ends this
+  // process's turn, or if another hart woke a process
+  // that should run instead. a real-time process that
+  // used up its budget waits for its next one.
+  if((which_dev == 2 && sched_tick()) || resched()){
+    if(p->throttled)
+      sched_throttle();
+    else
+      yield();
+  }
 
   usertrapret();
 }
@@ -139,7 +156,7 @@ usertrapret(void)
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(p->trapva, satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -152,14 +169,6 @@ kerneltrap()
   uint64 sstatus = r_sstatus();
   uint64 scause = r_scause();
 
-  #ifndef FCFS
-  int time;
-
-  acquire(&tickslock);
-  time = (int)ticks;
-  release(&tickslock);
-  #endif
-  
   if((sstatus & SSTATUS_SPP) == 0)
     panic("kerneltrap: not from supervisor mode");
   if(intr_get() != 0)
@@ -171,13 +180,12 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  #ifdef FCFS
-  // do not yield
-  #else
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING && time % QUANTUM == 0) // timeintr every QUANTUM ticks
+  // give up the CPU if the timer interrupt ends this
+  // process's turn, or if another hart woke a process
+  // that should run instead.
+  if(myproc() != 0 && myproc()->state == RUNNING &&
+     ((which_dev == 2 && sched_tick()) || resched()))
     yield();
-  #endif
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -185,21 +193,62 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Program this hart's timer to interrupt at cycle count when.
+// Interrupts must be off.
 void
-clockintr()
+setdeadline(uint64 when)
 {
+  mycpu()->deadline = when;
+  *(uint64*)CLINT_MTIMECMP(cpuid()) = when;
+}
+
+// Return the cycle count at which the next tick starts.
+uint64
+nexttick(void)
+{
+  return (r_time() / TICKCYCLES + 1) * TICKCYCLES;
+}
+
+// Interrupt the given hart. timervec in kernelvec.S turns
+// this into a supervisor software interrupt on that hart.
+void
+ipi(int hart)
+{
+  *(uint32*)CLINT_MSIP(hart) = 1;
+}
+
+// Bring ticks up to the clock, which idle harts leave
+// behind since they don't take every tick, and run the
+// timers that are due.
+void
+tickcatchup(void)
+{
+  uint now = r_time() / TICKCYCLES;
+  int advanced = 0;
+
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  if(now > ticks){
+    ticks = now;
+    advanced = 1;
+  }
   release(&tickslock);
 
-  update_time();
+  if(advanced)
+    timer_tick();
+}
+
+// A hart's timer went off.
+void
+clockintr()
+{
+  tickcatchup();
+  setdeadline(nexttick());
 }
 
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
-// 1 if other device,
+// 1 if other device or IPI,
 // 0 if not recognized.
 int
 devintr()
@@ -229,18 +278,21 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    // it was the timer if this hart's deadline has passed.
+    if(r_time() >= mycpu()->deadline){
+      clockintr();
+      return 2;
+    }
+
+    // an IPI; it has done its job of waking us up.
+    return 1;
   } else {
     return 0;
   }
@@ -30,6 +30,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for timer deadlines and IPIs
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -43,9 +46,8 @@ kvmmake(void)
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // map kernel stacks
-  proc_mapstacks(kpgtbl);
-  
+  // kernel stacks are mapped as processes need them; see kstackalloc().
+
   return kpgtbl;
 }
 
@@ -169,10 +171,9 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    // sbrk() memory is only mapped once touched.
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -289,26 +290,40 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 }
 
 // Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// its memory from start to end into a child's
+// page table.
+// If cow is set, the child shares the parent's
+// physical pages, and writable ones become
+// read-only copy-on-write pages in both; see
+// uvmcow(). Otherwise copies the physical memory.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
   char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;  // not touched since sbrk()
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
+    // without cow, old has threads, and its copy-on-write
+    // pages must stay its own (see uvmcow()).
+    if(cow || (*pte & (PTE_W | PTE_COW)) == 0){
+      // share read-only pages, such as program text, and
+      // writable ones copy-on-write. new hasn't written
+      // any of them yet.
+      if(*pte & PTE_W)
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      if(mappages(new, i, PGSIZE, pa, PTE_FLAGS(*pte) & ~PTE_D) != 0)
+        goto err;
+      kref((void*)pa);
+      continue;
+    }
+    flags = PTE_FLAGS(*pte) & ~PTE_D;
     if((mem = kalloc()) == 0)
       goto err;
     memmove(mem, (char*)pa, PGSIZE);
@@ -317,13 +332,88 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
       goto err;
     }
   }
+  if(cow)
+    sfence_vma();  // old's writable pages are now read-only
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Give the page table its own copy of the copy-on-write
+// page at va, or if no other page table shares the page
+// any more, just make it writable again; either way it is
+// about to be written, so mark it dirty. Only a page table
+// used by one thread may share copy-on-write pages, so
+// flushing this hart's TLB is enough: other harts at most
+// fault again on the read-only mapping they remember.
+// Returns -1 if va isn't a copy-on-write user page,
+// or if memory runs out.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_V | PTE_U | PTE_COW)) != (PTE_V | PTE_U | PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W | PTE_D;
+  if(krefs((void*)pa) > 1){
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    kfree((void*)pa);
+  } else {
+    *pte = PA2PTE(pa) | flags;
+  }
+  sfence_vma();
+  return 0;
+}
+
+// Map a zeroed page at va, in memory that sbrk() grew
+// but nothing has touched yet. Returns -1 if memory
+// runs out.
+int
+uvmlazy(pagetable_t pagetable, uint64 va)
+{
+  char *mem;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Copy every copy-on-write page from start to end that
+// is shared, before the page table is shared by threads.
+// Returns -1 if memory runs out.
+int
+uvmunshare(pagetable_t pagetable, uint64 start, uint64 end)
+{
+  pte_t *pte;
+  uint64 i;
+
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = walk(pagetable, i, 0)) != 0 && (*pte & PTE_COW) &&
+       krefs((void*)PTE2PA(*pte)) > 1 && uvmcow(pagetable, i) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -344,12 +434,21 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
+      return -1;
+    pte = walk(pagetable, va0, 0);
+    if((pte == 0 || (*pte & (PTE_V|PTE_W)) != (PTE_V|PTE_W)) &&
+       pagefault(pagetable, va0, PTE_W) < 0)
+      return -1;
+    // program text may be shared, and is read-only.
+    pte = walk(pagetable, va0, 0);
+    if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W))
       return -1;
+    pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -373,7 +472,8 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pagefault(pagetable, va0, PTE_R) < 0 ||
+                    (pa0 = walkaddr(pagetable, va0)) == 0))
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -400,7 +500,8 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pagefault(pagetable, va0, PTE_R) < 0 ||
+                    (pa0 = walkaddr(pagetable, va0)) == 0))
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
@@ -0,0 +1,114 @@
+// Scheduler load-balance benchmark.
+// Runs one batch of CPU-bound workers, then one batch of
+// workers that fork short-lived children like forktest,
+// and reports for each worker how long it ran, how long it
+// sat on a run queue, and how often it was stolen by
+// another cpu. Parallelism is total run time divided by
+// elapsed time; it approaches the number of harts when
+// idle harts steal work instead of spinning.
+//
+// usage: balance [nworkers]
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/perf.h"
+#include "user/user.h"
+
+#define SPIN     20000000
+#define NCHILD   20
+
+void
+spin(int n)
+{
+  volatile int x = 0;
+  int i;
+
+  for(i = 0; i < n; i++)
+    x++;
+}
+
+void
+cpuworker(void)
+{
+  spin(5*SPIN);
+  exit(0);
+}
+
+void
+forkworker(void)
+{
+  int i, pid;
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("balance: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      spin(SPIN/10);
+      exit(0);
+    }
+    spin(SPIN/10);
+  }
+  for(i = 0; i < NCHILD; i++)
+    wait(0);
+  exit(0);
+}
+
+void
+run(char *name, void (*worker)(void), int n)
+{
+  struct perf perf;
+  int i, pid, start, elapsed, rutime, retime, migrations;
+
+  printf("%s: %d workers\n", name, n);
+  start = uptime();
+  for(i = 0; i < n; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("balance: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      worker();
+  }
+
+  rutime = retime = migrations = 0;
+  for(i = 0; i < n; i++){
+    pid = wait_stat(0, &perf);
+    if(pid < 0){
+      printf("balance: wait_stat failed\n");
+      exit(1);
+    }
+    printf("  pid %d: running %d runnable %d migrations %d\n",
+           pid, perf.rutime, perf.retime, perf.migrations);
+    rutime += perf.rutime;
+    retime += perf.retime;
+    migrations += perf.migrations;
+  }
+  elapsed = uptime() - start;
+  if(elapsed == 0)
+    elapsed = 1;
+
+  printf("%s: elapsed %d running %d runnable %d migrations %d parallelism %d.%d\n",
+         name, elapsed, rutime, retime, migrations,
+         rutime / elapsed, (rutime * 10 / elapsed) % 10);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n = NCPU;
+
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n < 1){
+    fprintf(2, "usage: balance [nworkers]\n");
+    exit(1);
+  }
+
+  run("cpu", cpuworker, n);
+  run("fork", forkworker, n);
+  exit(0);
+}
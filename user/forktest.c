@@ -1,11 +1,13 @@
 // Test that fork fails gracefully.
-// Tiny executable so that the limit can be filling the proc table.
+// Tiny executable so that the limit can be filling the proc table,
+// if memory doesn't run out first.
 
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "kernel/stat.h"
 #include "user/user.h"
 
-#define N  1000
+#define N  (NPROC + 1)
 
 void
 print(const char *s)
@@ -0,0 +1,219 @@
+// Lock contention benchmark.
+// Threads take turns incrementing a shared counter under
+// a lock, with 1, 2, 4, ... up to NCPU threads, using
+// first a futex mutex and then a lock made of a pipe
+// holding one token byte, and reports the ticks each run
+// took. A bounded buffer then passes items from producer
+// to consumer threads with a mutex and two condition
+// variables, and again with two semaphores, checking
+// that every item arrives exactly once.
+//
+// usage: futexbench [iterations]
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define STACKSIZE 4096
+#define NSLOT     8
+
+int iters = 100000;
+int counter;
+
+struct mutex mu;
+int lockpipe[2];
+
+int buf[NSLOT];
+int head, tail, count;
+struct cond notfull, notempty;
+struct sem slots, items;
+struct mutex bufmu;
+int total;
+
+int
+spawn(void (*fn)(void*), void *arg)
+{
+  char *stack;
+
+  if((stack = malloc(STACKSIZE)) == 0)
+    return -1;
+  return clone(fn, (void*)((uint64)(stack + STACKSIZE) & ~15), 0, arg);
+}
+
+void
+mutexworker(void *arg)
+{
+  int i, n = (uint64)arg;
+
+  for(i = 0; i < n; i++){
+    mutex_lock(&mu);
+    counter++;
+    mutex_unlock(&mu);
+  }
+  exit(0);
+}
+
+void
+pipeworker(void *arg)
+{
+  int i, n = (uint64)arg;
+  char c;
+
+  for(i = 0; i < n; i++){
+    read(lockpipe[0], &c, 1);
+    counter++;
+    write(lockpipe[1], &c, 1);
+  }
+  exit(0);
+}
+
+// Run nthread copies of fn sharing iters increments;
+// return the ticks taken.
+int
+run(void (*fn)(void*), int nthread)
+{
+  int i, start;
+  int tid[NCPU];
+
+  counter = 0;
+  start = uptime();
+  for(i = 0; i < nthread; i++){
+    if((tid[i] = spawn(fn, (void*)(uint64)(iters / nthread))) < 0){
+      printf("futexbench: clone failed\n");
+      exit(1);
+    }
+  }
+  for(i = 0; i < nthread; i++)
+    join(tid[i], 0);
+  if(counter != iters / nthread * nthread){
+    printf("futexbench: lost increments: %d\n", counter);
+    exit(1);
+  }
+  return uptime() - start;
+}
+
+void
+condproducer(void *arg)
+{
+  int i, n = (uint64)arg;
+
+  for(i = 1; i <= n; i++){
+    mutex_lock(&bufmu);
+    while(count == NSLOT)
+      cond_wait(&notfull, &bufmu);
+    buf[tail] = i;
+    tail = (tail + 1) % NSLOT;
+    count++;
+    cond_signal(&notempty);
+    mutex_unlock(&bufmu);
+  }
+  exit(0);
+}
+
+void
+condconsumer(void *arg)
+{
+  int i, n = (uint64)arg;
+
+  for(i = 0; i < n; i++){
+    mutex_lock(&bufmu);
+    while(count == 0)
+      cond_wait(&notempty, &bufmu);
+    total += buf[head];
+    head = (head + 1) % NSLOT;
+    count--;
+    cond_signal(&notfull);
+    mutex_unlock(&bufmu);
+  }
+  exit(0);
+}
+
+void
+semproducer(void *arg)
+{
+  int i, n = (uint64)arg;
+
+  for(i = 1; i <= n; i++){
+    sem_wait(&slots);
+    mutex_lock(&bufmu);
+    buf[tail] = i;
+    tail = (tail + 1) % NSLOT;
+    mutex_unlock(&bufmu);
+    sem_post(&items);
+  }
+  exit(0);
+}
+
+void
+semconsumer(void *arg)
+{
+  int i, n = (uint64)arg;
+
+  for(i = 0; i < n; i++){
+    sem_wait(&items);
+    mutex_lock(&bufmu);
+    total += buf[head];
+    head = (head + 1) % NSLOT;
+    mutex_unlock(&bufmu);
+    sem_post(&slots);
+  }
+  exit(0);
+}
+
+// Pass n items from each of NCPU/2 producers to as many
+// consumers; return the ticks taken.
+int
+bufrun(void (*producer)(void*), void (*consumer)(void*), int n)
+{
+  int i, start, want;
+  int tid[NCPU];
+
+  head = tail = count = total = 0;
+  start = uptime();
+  for(i = 0; i < NCPU; i++){
+    if((tid[i] = spawn(i % 2 ? consumer : producer, (void*)(uint64)n)) < 0){
+      printf("futexbench: clone failed\n");
+      exit(1);
+    }
+  }
+  for(i = 0; i < NCPU; i++)
+    join(tid[i], 0);
+  want = NCPU / 2 * (n * (n + 1) / 2);
+  if(total != want){
+    printf("futexbench: buffer total %d, want %d\n", total, want);
+    exit(1);
+  }
+  return uptime() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+  char c = 0;
+
+  if(argc > 1)
+    iters = atoi(argv[1]);
+  if(iters < NCPU){
+    fprintf(2, "usage: futexbench [iterations]\n");
+    exit(1);
+  }
+
+  if(pipe(lockpipe) < 0 || write(lockpipe[1], &c, 1) != 1){
+    printf("futexbench: pipe failed\n");
+    exit(1);
+  }
+  mutex_init(&mu);
+  for(n = 1; n <= NCPU; n *= 2)
+    printf("%d threads: futex mutex %d ticks, pipe lock %d ticks\n",
+           n, run(mutexworker, n), run(pipeworker, n));
+
+  mutex_init(&bufmu);
+  cond_init(&notfull);
+  cond_init(&notempty);
+  printf("condvar buffer: %d ticks\n", bufrun(condproducer, condconsumer, iters / NCPU));
+  sem_init(&slots, NSLOT);
+  sem_init(&items, 0);
+  printf("semaphore buffer: %d ticks\n", bufrun(semproducer, semconsumer, iters / NCPU));
+  exit(0);
+}
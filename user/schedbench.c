@@ -0,0 +1,131 @@
+// Scheduling policy benchmark.
+// Runs the same mix of CPU-bound and interactive workers
+// under each scheduling policy in turn, switching with
+// sched_setpolicy() rather than rebuilding the kernel, and
+// reports each policy's elapsed time and the average
+// turnaround and runnable (waiting) time of each kind of
+// worker. Interactive workers sleep between short bursts,
+// so their waiting time shows how quickly a policy lets
+// them back on the cpu. EDF needs parameters, so in its
+// run only the interactive workers are EDF processes,
+// with a budget of one tick every two, next to CPU-bound
+// workers under the default policy; it reports how many
+// deadlines they missed.
+//
+// usage: schedbench [nworkers]
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/perf.h"
+#include "kernel/sched.h"
+#include "user/user.h"
+
+#define SPIN     20000000
+#define NBURST   10
+
+char *names[] = {
+[SCHED_DEFAULT] "default",
+[SCHED_FCFS]    "fcfs",
+[SCHED_SRT]     "srt",
+[SCHED_CFSD]    "cfsd",
+[SCHED_MLFQ]    "mlfq",
+[SCHED_EDF]     "edf",
+};
+
+void
+spin(int n)
+{
+  volatile int x = 0;
+  int i;
+
+  for(i = 0; i < n; i++)
+    x++;
+}
+
+void
+cpuworker(void)
+{
+  spin(3*SPIN);
+  exit(0);
+}
+
+void
+ioworker(int policy)
+{
+  int i;
+
+  if(policy == SCHED_EDF && sched_setdeadline(1, 2, 2) < 0)
+    printf("schedbench: sched_setdeadline failed\n");
+
+  for(i = 0; i < NBURST; i++){
+    spin(SPIN/100);
+    sleep(1);
+  }
+  exit(1);
+}
+
+void
+run(int policy, int n)
+{
+  struct perf perf;
+  int i, pid, status, start, elapsed;
+  int turnaround[2], retime[2], count[2], misses;
+
+  if(sched_setpolicy(0, policy == SCHED_EDF ? SCHED_DEFAULT : policy) < 0){
+    printf("schedbench: sched_setpolicy failed\n");
+    exit(1);
+  }
+
+  start = uptime();
+  for(i = 0; i < 2*n; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("schedbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      if(i % 2)
+        ioworker(policy);
+      cpuworker();
+    }
+  }
+
+  // exit status tells the kinds apart: 0 cpu, 1 interactive.
+  for(i = 0; i < 2; i++)
+    turnaround[i] = retime[i] = count[i] = 0;
+  misses = 0;
+  for(i = 0; i < 2*n; i++){
+    if(wait_stat(&status, &perf) < 0){
+      printf("schedbench: wait_stat failed\n");
+      exit(1);
+    }
+    turnaround[status] += perf.ttime - perf.ctime;
+    retime[status] += perf.retime;
+    count[status]++;
+    misses += perf.misses;
+  }
+  elapsed = uptime() - start;
+
+  printf("%s: elapsed %d cpu turnaround %d runnable %d io turnaround %d runnable %d misses %d\n",
+         names[policy], elapsed,
+         turnaround[0] / count[0], retime[0] / count[0],
+         turnaround[1] / count[1], retime[1] / count[1], misses);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n = NCPU;
+  int policy;
+
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n < 1){
+    fprintf(2, "usage: schedbench [nworkers]\n");
+    exit(1);
+  }
+
+  for(policy = 0; policy < NSCHED; policy++)
+    run(policy, n);
+  exit(0);
+}
@@ -1,16 +1,8 @@
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
-
-struct perf {
-  int ctime;                // Process creation time
-  int ttime;                // Process termination time
-  int stime;                // The total time the process spent in the SLEEPING mode
-  int retime;               // The total time the process spent in the RUNNABLE mode
-  int rutime;               // The total time the process spent in the RUNNING mode
-  int average_bursttime;    // Approximate estimated burst time
-};
-
+#include "kernel/perf.h"
 
 int main(int argc, char** argv){
     int i;
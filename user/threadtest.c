@@ -0,0 +1,115 @@
+// Test clone() and join().
+// Threads sum slices of a shared array in parallel and
+// report through shared memory and their exit status;
+// then a process exits with a thread still spinning,
+// which exit() must kill before the process is reaped.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define N         (1 << 16)
+#define STACKSIZE 4096
+
+int a[N];
+int sums[NCPU];
+
+void
+sum(void *arg)
+{
+  int i, id = (uint64)arg;
+  int s = 0;
+
+  for(i = id * (N / NCPU); i < (id + 1) * (N / NCPU); i++)
+    s += a[i];
+  sums[id] = s;
+  exit(id);
+}
+
+void
+spin(void *arg)
+{
+  for(;;)
+    ;
+}
+
+// Start fn(arg) in a new thread with a fresh stack.
+int
+spawn(void (*fn)(void*), void *arg)
+{
+  char *stack;
+
+  if((stack = malloc(STACKSIZE)) == 0)
+    return -1;
+  return clone(fn, (void*)((uint64)(stack + STACKSIZE) & ~15), 0, arg);
+}
+
+void
+sumtest(void)
+{
+  int i, status, total;
+  int tid[NCPU];
+
+  printf("sum test\n");
+  for(i = 0; i < N; i++)
+    a[i] = i % 7;
+  for(i = 0; i < NCPU; i++){
+    if((tid[i] = spawn(sum, (void*)(uint64)i)) < 0){
+      printf("threadtest: clone failed\n");
+      exit(1);
+    }
+  }
+  total = 0;
+  for(i = 0; i < NCPU; i++){
+    if(join(tid[i], &status) != tid[i] || status != i){
+      printf("threadtest: join %d failed\n", tid[i]);
+      exit(1);
+    }
+    total += sums[i];
+  }
+  if(join(tid[0], 0) != -1 || join(getpid(), 0) != -1){
+    printf("threadtest: joined a thread twice\n");
+    exit(1);
+  }
+
+  for(i = 0; i < N; i++)
+    total -= a[i];
+  if(total != 0){
+    printf("threadtest: wrong sum\n");
+    exit(1);
+  }
+  printf("sum test OK\n");
+}
+
+void
+exittest(void)
+{
+  int pid;
+
+  printf("exit test\n");
+  pid = fork();
+  if(pid < 0){
+    printf("threadtest: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    if(spawn(spin, 0) < 0){
+      printf("threadtest: clone failed\n");
+      exit(1);
+    }
+    exit(0);
+  }
+  if(wait(0) != pid){
+    printf("threadtest: wait failed\n");
+    exit(1);
+  }
+  printf("exit test OK\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  sumtest();
+  exittest();
+  exit(0);
+}
@@ -134,3 +134,112 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// Futex-based locks. The fast paths are a single atomic
+// instruction; only contended operations enter the
+// kernel. The mutex is the three-state one from Drepper's
+// "Futexes Are Tricky": unlock only calls futex_wake() if
+// some thread may be waiting.
+
+static int
+cas(int *addr, int old, int new)
+{
+  __atomic_compare_exchange_n(addr, &old, new, 0,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return old;
+}
+
+void
+mutex_init(struct mutex *m)
+{
+  m->state = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+  int c;
+
+  if((c = cas(&m->state, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_SEQ_CST);
+  while(c != 0){
+    futex_wait(&m->state, 2);
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_SEQ_CST);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__atomic_fetch_sub(&m->state, 1, __ATOMIC_SEQ_CST) != 1){
+    __atomic_store_n(&m->state, 0, __ATOMIC_SEQ_CST);
+    futex_wake(&m->state, 1);
+  }
+}
+
+void
+cond_init(struct cond *c)
+{
+  c->seq = 0;
+}
+
+// A signal that lands between the load of seq and
+// futex_wait() changes seq, so the wait returns at once.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq = __atomic_load_n(&c->seq, __ATOMIC_SEQ_CST);
+
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq);
+  mutex_lock(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __atomic_fetch_add(&c->seq, 1, __ATOMIC_SEQ_CST);
+  futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __atomic_fetch_add(&c->seq, 1, __ATOMIC_SEQ_CST);
+  futex_wake(&c->seq, 0x7fffffff);
+}
+
+void
+sem_init(struct sem *s, int count)
+{
+  s->count = count;
+  s->waiters = 0;
+}
+
+void
+sem_wait(struct sem *s)
+{
+  int c;
+
+  for(;;){
+    c = __atomic_load_n(&s->count, __ATOMIC_SEQ_CST);
+    if(c > 0){
+      if(cas(&s->count, c, c - 1) == c)
+        return;
+      continue;
+    }
+    __atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+    futex_wait(&s->count, 0);
+    __atomic_fetch_sub(&s->waiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void
+sem_post(struct sem *s)
+{
+  __atomic_fetch_add(&s->count, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST) > 0)
+    futex_wake(&s->count, 1);
+}
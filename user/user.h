@@ -2,6 +2,21 @@ struct stat;
 struct rtcdate;
 struct perf;
 
+// Blocking synchronization for threads, built on futexes
+// (see ulib.c). Zeroed is the same as initialized.
+struct mutex {
+  int state;          // 0 unlocked, 1 locked, 2 locked with waiters
+};
+
+struct cond {
+  int seq;            // Bumped by each signal
+};
+
+struct sem {
+  int count;
+  int waiters;        // Threads in or about to be in futex_wait()
+};
+
 // system calls
 int fork(void);
 int exit(int) __attribute__((noreturn));
@@ -27,6 +42,14 @@ int uptime(void);
 int trace(int, int);
 int wait_stat(int*, struct perf*);
 int set_priority(int);
+int sched_setpolicy(int, int);
+int sched_setdeadline(int, int, int);
+int clone(void (*)(void*), void*, int, void*);
+int join(int, int*);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
+void *mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -44,3 +67,13 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
+void sem_init(struct sem*, int);
+void sem_wait(struct sem*);
+void sem_post(struct sem*);
@@ -2041,12 +2041,13 @@ iref(char *s)
 }
 
 // test that fork fails gracefully
-// the forktest binary also does this, but it runs out of proc entries first.
-// inside the bigger usertests binary, we run out of memory first.
+// the forktest binary also does this, but it may run out of proc entries first.
+// inside the bigger usertests binary, we run out of memory first, though
+// with copy-on-write fork that takes nearly as many forks.
 void
 forktest(char *s)
 {
-  enum{ N = 1000 };
+  enum{ N = NPROC + 1 };
   int n, pid;
 
   for(n=0; n<N; n++){
@@ -2063,7 +2064,7 @@ forktest(char *s)
   }
 
   if(n == N){
-    printf("%s: fork claimed to work 1000 times!\n", s);
+    printf("%s: fork claimed to work %d times!\n", s, N);
     exit(1);
   }
 
@@ -2080,6 +2081,372 @@ forktest(char *s)
   }
 }
 
+// fork a process too big to copy, and check that parent
+// and child each see only their own writes.
+void
+cowfork(char *s)
+{
+  enum { BIG=60*1024*1024 };
+  char *a, *p;
+  int pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 4096)
+    *p = 'p';
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + BIG; p += 64*4096){
+      if(*p != 'p'){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+      *p = 'c';
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(p = a; p < a + BIG; p += 4096){
+    if(*p != 'p'){
+      printf("%s: parent sees child's write\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-BIG);
+}
+
+// program text is shared and read-only: neither the
+// program nor read() may write it, nor may anything
+// write the file of a running program.
+void
+textwrite(char *s)
+{
+  int pid, xstatus, fd;
+  volatile int *text = (int*)textwrite;
+  char c;
+
+  // writes back what is there, should it succeed.
+  fd = open("usertests", O_RDWR);
+  if(fd < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  if(read(fd, &c, 1) != 1){
+    printf("%s: read usertests failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("usertests", O_WRONLY);
+  if(fd < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  if(write(fd, &c, 1) != -1){
+    printf("%s: wrote a running program\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("echo", 0);
+  if(fd < 0){
+    printf("%s: open echo failed\n", s);
+    exit(1);
+  }
+  if(read(fd, (void*)text, 8) != -1){
+    printf("%s: read into text succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    *text = 10;
+    printf("%s: wrote text\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != -1)  // did kernel kill child?
+    exit(1);
+}
+
+// more EDF processes than harts: jobs miss their deadlines,
+// but each process must still get the cpu in turn.
+void
+edfoverrun(char *s)
+{
+  enum { N=8, RUN=20 };
+  int i, n, pid, xstatus, end, fail = 0;
+
+  end = uptime() + RUN;
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      if(sched_setdeadline(1, 2, 2) < 0)
+        exit(0);  // not admitted; nothing to check.
+      n = 0;
+      while(uptime() < end)
+        n++;
+      exit(n > 0 ? 0 : 1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      fail = 1;
+  }
+  if(fail){
+    printf("%s: an EDF process never ran\n", s);
+    exit(1);
+  }
+}
+
+// map a file privately and shared, and anonymous memory;
+// check what the file and a forked child see, and that
+// unmapped memory faults.
+void
+mmaptest(char *s)
+{
+  enum { N=2*4096+100 };
+  int fd, fd2, i, pid, xstatus;
+  char *a, *b;
+
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    buf[i] = 'a' + i % 23;
+  if(write(fd, buf, N) != N){
+    printf("%s: write mmapfile failed\n", s);
+    exit(1);
+  }
+
+  // private: writes stay in memory.
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(a[i] != 'a' + i % 23){
+      printf("%s: mmap private wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(a[N] != 0){
+    printf("%s: mmap past end of file not zero\n", s);
+    exit(1);
+  }
+  a[0] = 'X';
+  if(munmap(a, N) < 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  // shared: writes reach the file, which doesn't grow.
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 'a'){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  a[0] = 'Y';
+  a[N - 1] = 'Z';
+  a[N] = 'W';
+  // a page that is only read isn't written back.
+  if(a[4096] != 'a' + 4096 % 23){
+    printf("%s: mmap shared wrong data\n", s);
+    exit(1);
+  }
+  fd2 = open("mmapfile", O_RDWR);
+  if(fd2 < 0 || read(fd2, buf, 4096) != 4096 || write(fd2, "Q", 1) != 1){
+    printf("%s: write mmapfile failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+  // unmap the first page, then the rest.
+  if(munmap(a, 4096) < 0 || munmap(a + 4096, N - 4096) < 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 4097) != 4097 || buf[0] != 'Y'){
+    printf("%s: shared write lost\n", s);
+    exit(1);
+  }
+  if(buf[4096] != 'Q'){
+    printf("%s: clean shared page written back\n", s);
+    exit(1);
+  }
+  b = mmap(0, N, PROT_READ, MAP_SHARED, fd, 0);
+  if(b == (char*)-1 || b[N - 1] != 'Z' || b[N] != 0){
+    printf("%s: shared write lost at end of file\n", s);
+    exit(1);
+  }
+  if(mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: writable mapping of read-only file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+
+  // anonymous memory is zeroed, and copied by fork().
+  a = mmap(0, 10*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 10*4096; i += 4096){
+    if(a[i] != 0){
+      printf("%s: anonymous memory not zeroed\n", s);
+      exit(1);
+    }
+    a[i] = i / 4096;
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(a[9*4096] != 9 || b[0] != 'Y'){
+      printf("%s: child sees wrong data\n", s);
+      exit(1);
+    }
+    a[9*4096] = 99;
+    munmap(a, 10*4096);
+    a[0] = 1;
+    printf("%s: wrote unmapped memory\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != -1)  // did kernel kill child?
+    exit(1);
+  if(a[9*4096] != 9){
+    printf("%s: parent sees child's write\n", s);
+    exit(1);
+  }
+  munmap(a, 10*4096);
+  munmap(b, N);
+
+  // a file's shared mappings, in any process, are one
+  // copy, which read() sees too.
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, 4096) != 4096){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+  a = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  a[0] = 'P';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(a[0] != 'P'){
+      printf("%s: child doesn't see shared write\n", s);
+      exit(1);
+    }
+    a[1] = 'C';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  if(a[1] != 'C'){
+    printf("%s: parent doesn't see child's shared write\n", s);
+    exit(1);
+  }
+  a[2] = 'R';
+  fd2 = open("mmapfile", O_RDONLY);
+  if(fd2 < 0 || read(fd2, buf, 3) != 3 || buf[2] != 'R'){
+    printf("%s: read doesn't see shared write\n", s);
+    exit(1);
+  }
+  close(fd2);
+  munmap(a, 4096);
+  close(fd);
+  unlink("mmapfile");
+
+  // pages that can't be written back, here to a running
+  // program, make munmap() fail.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    fd = open("usertests", O_RDWR);
+    if(fd < 0){
+      printf("%s: open usertests failed\n", s);
+      exit(1);
+    }
+    a = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(a == (char*)-1){
+      printf("%s: mmap usertests failed\n", s);
+      exit(1);
+    }
+    *(volatile char*)a = a[0];
+    if(munmap(a, 4096) != -1){
+      printf("%s: munmap wrote back a running program\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+
+  // memory mapped without PROT_EXEC can't be run.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(a == (char*)-1){
+      printf("%s: mmap anonymous failed\n", s);
+      exit(1);
+    }
+    *(uint*)a = 0x00008067;  // ret
+    ((void (*)(void))a)();
+    printf("%s: ran memory mapped without PROT_EXEC\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != -1)  // did kernel kill child?
+    exit(1);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2094,19 +2461,12 @@ sbrkbasic(char *s)
     exit(1);
   }
   if(pid == 0){
+    // more than physical memory, even lazily, must fail.
     a = sbrk(TOOMUCH);
     if(a == (char*)0xffffffffffffffffL){
-      // it's OK if this fails.
       exit(0);
     }
-    
-    for(b = a; b < a+TOOMUCH; b += 4096){
-      *b = 99;
-    }
-    
-    // we should not get here! either sbrk(TOOMUCH)
-    // should have failed, or (with lazy allocation)
-    // a pagefault should have killed this process.
+    printf("%s: sbrk(TOOMUCH) succeeded\n", s);
     exit(1);
   }
 
@@ -2825,6 +3185,10 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {cowfork, "cowfork"},
+    {textwrite, "textwrite"},
+    {mmaptest, "mmaptest"},
+    {edfoverrun, "edfoverrun"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
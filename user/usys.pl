@@ -39,3 +39,11 @@ entry("uptime");
 entry("trace");
 entry("wait_stat");
 entry("set_priority");
+entry("sched_setpolicy");
+entry("sched_setdeadline");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("mmap");
+entry("munmap");